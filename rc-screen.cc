@@ -11,75 +11,683 @@
  *  - A7/ICP: IR receiver input from TSOP 38. Connected to A7/ICP. Low active.
  *  - AIN0  : Wheel encoder. Analog input comparing to AIN1. AIN1 is a voltage
  *            divider biased by another output of ours -> Schmitt trigger.
- *  - B1    : End-switch, active low.
+ *            Once calibrated, sampled with the ADC instead.
+ *  - B1    : End-switch, active low. A5 with a crystal (AVR_MHZ).
+ *  - A5    : Optional second wheel encoder channel (QUADRATURE_ENCODER).
+ *  - A3    : Optional wired trigger, active low (WIRED_TRIGGER). E.g. the
+ *            12V trigger output of the projector through an optocoupler.
+ *            Or the bus to other screens, open drain (SYNC_BUS).
  *
  * Outputs
- *  - B0/A6 : Motor up/down (connected to H-Bridge)
+ *  - B0/A6 : Motor up/down (connected to H-Bridge). A3/A6 with a crystal.
+ *  - B2/OC0A: Motor speed: PWM to the enable input of the H-Bridge.
  *  - A0    : Schmitt Trigger bias
- *  - A4    : Debug LED.
- *
- * TODO
- - 'program' low position.
-*/
+ *  - A4    : Debug LED. Also sends the diagnostics, 19200 baud 8N1
+ *            (DIAGNOSTICS).
+ */
 
-#define AVR_MHZ 8
+// CPU clock. The internal RC oscillator gives 8MHz; anything else is a
+// crystal (16 or 20MHz) on B0/B1, XTAL1/XTAL2. Then the endswitch moves to
+// A5 and motor up to A3, so there is no second encoder channel.
+#ifndef AVR_MHZ
+#  define AVR_MHZ 8
+#endif
 #define F_CPU (AVR_MHZ * 1000000UL)
+#define CRYSTAL (AVR_MHZ != 8)
 
 #include <avr/io.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/delay.h>
+#include <stddef.h>
+
+// With a second optical sensor on the encoder wheel, we know the
+// direction of rotation, so the position stays right while coasting or
+// when the screen is moved by hand.
+#ifndef QUADRATURE_ENCODER
+#  define QUADRATURE_ENCODER 0
+#endif
+#if QUADRATURE_ENCODER && CRYSTAL
+#  error "The crystal takes the pins; QUADRATURE_ENCODER needs AVR_MHZ=8"
+#endif
+
+// Wired trigger input: the screen comes down while it is active and goes
+// up when it is released. Reacts right away, without a line of sight.
+#ifndef WIRED_TRIGGER
+#  define WIRED_TRIGGER 0
+#endif
+#if WIRED_TRIGGER && CRYSTAL
+#  error "The crystal takes the pins; WIRED_TRIGGER needs AVR_MHZ=8"
+#endif
+
+// Screens side by side moving together: the master takes the remote
+// control and tells the followers over a wire where it is going and how
+// fast. 0: no bus, or SYNC_MASTER or SYNC_FOLLOWER.
+#define SYNC_MASTER   1
+#define SYNC_FOLLOWER 2
+#ifndef SYNC_BUS
+#  define SYNC_BUS 0
+#endif
+#if SYNC_BUS && (CRYSTAL || WIRED_TRIGGER)
+#  error "SYNC_BUS needs A3: AVR_MHZ=8, and no WIRED_TRIGGER"
+#endif
+
+// Counters in EEPROM for finding out what went wrong, sent out on the LED
+// pin on request.
+#ifndef DIAGNOSTICS
+#  define DIAGNOSTICS 0
+#endif
+
+// Other remotes learned into EEPROM, in addition to the Epson one.
+#ifndef LEARN_REMOTES
+#  define LEARN_REMOTES 0
+#endif
+
+// Decoders for RC5 and Sony SIRC as well as NEC. Only good for remotes
+// learned into EEPROM: the Epson one speaks NEC.
+#ifndef RC5_SONY
+#  define RC5_SONY 0
+#endif
+#if RC5_SONY && !LEARN_REMOTES
+#  error "RC5_SONY is for learned remotes; it needs LEARN_REMOTES=1"
+#endif
+
+// Motor stalls if the next tick takes this many times the average period,
+// or if the average gets this many times slower than it was in this move.
+#ifndef STALL_FACTOR
+#  define STALL_FACTOR 3
+#endif
 
 typedef unsigned char byte_t;
 
-// -- Used ports. Named {IN,OUT}_[name]_[io-portname]
+// -- Used ports. Named {IN,OUT}_[name]_[io-portname]; the two without
+// port name move with the clock source, see MOT_UP_PORT and ENDSWITCH_PIN.
+#if CRYSTAL
+#  define MOT_UP_PORT   PORTA
+#  define ENDSWITCH_PIN PINA
+#else
+#  define MOT_UP_PORT   PORTB
+#  define ENDSWITCH_PIN PINB
+#endif
 enum {
-  IN_ENDSWITCH_B  = (1<<1),  // Endswitch, active low.
+#if CRYSTAL
+  IN_ENDSWITCH    = (1<<5),  // A5. Endswitch, active low.
+  OUT_MOT_UP      = (1<<3),  // A3. H-bridge #2
+#else
+  IN_ENDSWITCH    = (1<<1),  // B1. Endswitch, active low.
+  OUT_MOT_UP      = (1<<0),  // B0. H-bridge #2
+  IN_TRIGGER_A    = (1<<3),  // Optional wired trigger, active low.
+  IO_SYNC_A       = (1<<3),  // Optional sync bus, open drain.
+#endif
   IN_IR_A         = (1<<7),  // Infrared receiver. Idle high.
   IN_RESET_B      = (1<<3),  // To set the pullup.
+  IN_ENCODER2_A   = (1<<5),  // Optional 2nd encoder channel. Quadrature.
 
   OUT_STATUSLED_A = (1<<4),  // Some LED. Lit on high.
   OUT_MOT_DN_A    = (1<<6),  // H-bridge #1
-  OUT_MOT_UP_B    = (1<<0),  // H-bridge #2
+  OUT_MOT_EN_B    = (1<<2),  // H-bridge enable; PWM from OC0A.
   OUT_STBIAS_A    = (1<<0),  // Schmitt-Trigger bias voltage.
 };
 
-// Switch Status LED.
-static void status_led(bool b) {
-  if (b)
-    PORTA |= OUT_STATUSLED_A;
-  else
-    PORTA &= ~OUT_STATUSLED_A;
-}
-
 static inline bool infrared_in() { return (PINA & IN_IR_A) != 0; }
 static inline bool endswitch_in() {
   // active low which will return true.
-  return (PINB & IN_ENDSWITCH_B) == 0;
+  return (ENDSWITCH_PIN & IN_ENDSWITCH) == 0;
 }
+#if WIRED_TRIGGER
+static inline bool trigger_in() { return (PINA & IN_TRIGGER_A) == 0; }
+#endif
+
+// Prescaler of Timer1: resolution vs. how often the high word of the clock
+// needs to be counted. Needs to be one of 64, 256, 1024.
+#ifndef CLOCK_PRESCALER
+#  define CLOCK_PRESCALER 64
+#endif
 
 namespace Clock {
 typedef unsigned short cycle_t;
+typedef unsigned long cycle32_t;
+
+static const unsigned short PRESCALER = CLOCK_PRESCALER;
+
+static volatile unsigned short high_word;  // Counted in overflow interrupt.
 
 static void init() {
-  TCCR1B = (1<<CS12) | (1<<CS10);  // clk/1024
+#if CLOCK_PRESCALER == 64
+  TCCR1B = (1<<CS11) | (1<<CS10);
+#elif CLOCK_PRESCALER == 256
+  TCCR1B = (1<<CS12);
+#elif CLOCK_PRESCALER == 1024
+  TCCR1B = (1<<CS12) | (1<<CS10);
+#else
+#  error "CLOCK_PRESCALER needs to be one of 64, 256, 1024"
+#endif
+  TIMSK1 |= (1<<TOIE1);
 }
 
-// The timer with aroud 7.8 kHz rolls over the 64k every 8.3 seconds: it
-// makes only sense to do unsigned time comparisons <= 8.3 seconds.
-// Returns clock ticks.
+// The timer with the default clk/64 at 8MHz runs at 125 kHz and rolls over
+// the 64k every 524 milliseconds (at 16MHz, clk/256: 1 second): it makes
+// only sense to do unsigned time comparisons shorter than that with this.
+// Good for short intervals with fine resolution. Returns clock ticks.
 static cycle_t now() { return TCNT1; }
 
-// Converts milliseconds into clock cycles. If you provide a constant
-// expression, the compiler will be able to replace this with a constant,
-// otherwise it'll get expensive (division and such).
-static cycle_t ms_to_cycles(unsigned short ms) {
-  return ms * (F_CPU / 1024/*prescaler*/) / 1000/*ms*/;
+// The timer extended by the overflow count to 32 bit. Rolls over every
+// 9.5 hours. For longer intervals.
+static cycle32_t now32() {
+  const byte_t sreg = SREG;
+  cli();
+  unsigned short high = high_word;
+  const unsigned short low = TCNT1;
+  // Overflow happened, but the interrupt didn't have a chance yet.
+  if ((TIFR1 & (1<<TOV1)) && low < 0x8000)
+    ++high;
+  SREG = sreg;
+  return ((cycle32_t) high << 16) | low;
 }
+
+// Converts milliseconds into clock cycles for intervals measured with
+// now32(). This is a template so that it is guaranteed to be evaluated at
+// compile time; it fails to compile if the result doesn't fit:
+// Cycles<4000>::value
+template <unsigned long ms> struct Cycles {
+  static_assert(ms <= 0xFFFFFFFFUL / (F_CPU / PRESCALER),
+                "Interval too long for the 32 bit clock");
+  static constexpr cycle32_t value = ms * (F_CPU / PRESCALER) / 1000/*ms*/;
+};
+
+// Converts microseconds into clock cycles, rounded to the nearest cycle,
+// for intervals measured with now(). Evaluated at compile time; fails to
+// compile if the result doesn't fit into the 16 bit clock:
+// Micros<1125>::cycles
+template <unsigned long us> struct Micros {
+  static constexpr unsigned long value32 =
+    (us * (F_CPU / 1000000UL) + PRESCALER / 2) / PRESCALER;
+  static_assert(value32 <= 0xFFFF,
+                "Interval too long for the 16 bit clock; use now32()");
+  static constexpr cycle_t cycles = value32;
+};
 } // end namespace Clock
 
+ISR(TIM1_OVF_vect) {
+  ++Clock::high_word;
+}
+
+// Events from the interrupt handlers to the main loop, in a ring buffer.
+// Interrupt handlers don't interrupt each other, so there is a single
+// producer and a single consumer: the producer only writes the head, the
+// consumer only writes the tail, so no locking is needed.
+namespace EventQueue {
+enum Type {
+  ROTATION_TICK,      // Encoder wheel tick, direction unknown.
+  ROTATION_TICK_UP,   // Encoder wheel tick, quadrature encoder: going up.
+  ROTATION_TICK_DOWN, // Same, going down.
+  ENDSWITCH_CHANGE,   // Endswitch pin changed.
+  INFRARED_RECEIVED,  // Infrared edges to decode.
+  TRIGGER_CHANGE,     // Wired trigger pin changed.
+  SYNC_RECEIVED,      // Frame from the master on the sync bus.
+};
+
+struct Event {
+  byte_t type;
+  Clock::cycle_t time;
+};
+
+static const byte_t SIZE = 8;  // Power of two.
+static Event events[SIZE];
+static volatile byte_t head;   // Next to write. Only written by producer.
+static volatile byte_t tail;   // Next to read. Only written by consumer.
+
+// Make sure the compiler doesn't move accesses to events[] across the
+// update of head or tail.
+static inline void barrier() { __asm__ __volatile__("" ::: "memory"); }
+
+// Producer: only to be called from interrupt handlers. If the queue is
+// full, the event is dropped.
+static void push(byte_t type, Clock::cycle_t time) {
+  const byte_t h = head;
+  if ((byte_t)(h - tail) == SIZE)
+    return;
+  Event *const event = &events[h & (SIZE - 1)];
+  event->type = type;
+  event->time = time;
+  barrier();
+  head = h + 1;
+}
+
+// Consumer: main loop. Returns false if there is no event.
+static bool pop(Event *event) {
+  const byte_t t = tail;
+  if (t == head)
+    return false;
+  barrier();
+  *event = events[t & (SIZE - 1)];
+  barrier();
+  tail = t + 1;
+  return true;
+}
+
+static inline bool empty() { return tail == head; }
+}  // end namespace EventQueue
+
+// Speed of the motor: PWM from Timer0 on OC0A to the enable input of the
+// H-bridge. Fast PWM at clk/1 is F_CPU/256, 31kHz and up, so nothing
+// audible.
+namespace MotorPwm {
+static const byte_t MIN_DUTY = 112;  // Where the motor still reliably turns.
+static const byte_t MAX_DUTY = 255;  // Constantly on.
+
+static void on(byte_t duty) {
+  OCR0A = duty;
+  TCCR0A = (1<<COM0A1) | (1<<WGM01) | (1<<WGM00);  // fast PWM, non-inverting
+  TCCR0B = (1<<CS00);                              // clk/1
+}
+
+static void set(byte_t duty) { OCR0A = duty; }
+
+// Stop timer; the pin falls back to its PORTB value, which is low.
+static void off() {
+  TCCR0A = 0;
+  TCCR0B = 0;
+}
+}  // end namespace MotorPwm
+
+// Status LED, showing a pattern of 16 bits, MSB first, 128ms each: it
+// repeats about every two seconds. The periodic wakeup shifts it out, so
+// blinking costs nothing in the main loop. It needs the timer though, so
+// no power-down while blinking.
+namespace StatusLed {
+enum Pattern {
+  OFF      = 0x0000,
+  ON       = 0xFFFF,
+  FAST     = 0xAAAA,   // Endswitch broken.
+  SLOW     = 0xFF00,   // No ticks from the encoder after starting the motor.
+  // Error codes: short blinks, then a pause.
+  BLINK_2  = 0xA000,   // Stall: ticks stopped while running.
+  BLINK_3  = 0xA800,   // Glitch storm on the encoder.
+  BLINK_4  = 0xAA00,   // Stored position corrupt.
+  BLINK_5  = 0xAA80,   // Hung again after resuming from a watchdog reset.
+  // Learning a remote: one to five blinks, for the button to press next.
+};
+static const byte_t WAKEUPS_PER_BIT = 4;   // Of 32ms.
+
+static volatile unsigned short pattern;
+// Only touched in the interrupt handler once the pattern is shown.
+static unsigned short shift_register;
+static byte_t bits_left;
+static byte_t wakeups;
+
+static void write(bool on) {
+  if (on)
+    PORTA |= OUT_STATUSLED_A;
+  else
+    PORTA &= ~OUT_STATUSLED_A;
+}
+
+// Show the pattern from its beginning, unless it is shown already.
+static void show(unsigned short p) {
+  if (p == pattern)
+    return;
+  const byte_t sreg = SREG;
+  cli();
+  pattern = p;
+  write(p & 0x8000);
+  shift_register = p << 1;
+  bits_left = 15;
+  wakeups = 0;
+  SREG = sreg;
+}
+
+static inline bool is_blinking() { return pattern != OFF && pattern != ON; }
+
+#if LEARN_REMOTES
+// 'n' short blinks, then a pause, like BLINK_2. n from 1 to 7.
+static unsigned short blinks(byte_t n) {
+  return (unsigned short) (FAST << (16 - 2 * n));
+}
+#endif
+
+#if DIAGNOSTICS
+// Something else used the pin. Back to the pattern; a blinking one is in
+// phase again with the next bit.
+static void restore() { write(pattern & 0x8000); }
+#endif
+
+// Called from the periodic wakeup.
+static void step() {
+  if (++wakeups < WAKEUPS_PER_BIT)
+    return;
+  wakeups = 0;
+  if (bits_left == 0) {
+    shift_register = pattern;
+    bits_left = 16;
+  }
+  write(shift_register & 0x8000);
+  shift_register <<= 1;
+  --bits_left;
+}
+}  // end namespace StatusLed
+
+// Keeps the position of the screen in EEPROM, so that after power-up we
+// know where we are without a homing run.
+//
+// The position is written whenever the screen stops; when it starts moving,
+// the slot is marked as such, so that a power loss while moving leaves no
+// valid position behind. To spread the wear of the EEPROM cells, each
+// position goes to the next slot of a ring. The newest slot is the one
+// whose successor doesn't continue the sequence number.
+namespace PositionStore {
+enum {
+  SLOT_COUNT = 8,
+  STATE_PARKED = 0xA5,  // Anything else: not valid.
+  STATE_MOVING = 0x00,
+};
+
+struct Slot {
+  short pos;
+  byte_t state;
+  byte_t seq;   // Written last: only then this is the newest slot.
+};
+static Slot eeprom_slots[SLOT_COUNT] EEMEM;
+
+static byte_t current_slot;
+static byte_t current_seq;
+static bool parked;   // Cached state of current slot; avoid needless writes.
+
+// Find the newest slot. Returns true and its position in 'pos' if it is
+// from a clean stop.
+static bool restore(short *pos) {
+  current_seq = eeprom_read_byte(&eeprom_slots[0].seq);
+  for (current_slot = 0; current_slot < SLOT_COUNT - 1; ++current_slot) {
+    const byte_t next_seq = eeprom_read_byte(&eeprom_slots[current_slot+1].seq);
+    if (next_seq != (byte_t)(current_seq + 1))
+      break;
+    current_seq = next_seq;
+  }
+  Slot *const slot = &eeprom_slots[current_slot];
+  parked = eeprom_read_byte(&slot->state) == STATE_PARKED;
+  *pos = (short) eeprom_read_word((const uint16_t*) &slot->pos);
+  return parked;
+}
+
+// Screen starts moving: the stored position is not valid anymore.
+static void invalidate() {
+  if (!parked)
+    return;
+  eeprom_write_byte(&eeprom_slots[current_slot].state, STATE_MOVING);
+  parked = false;
+}
+
+// Screen stopped at a known position.
+static void store(short pos) {
+  if (++current_slot == SLOT_COUNT)
+    current_slot = 0;
+  Slot *const slot = &eeprom_slots[current_slot];
+  eeprom_write_word((uint16_t*) &slot->pos, pos);
+  eeprom_write_byte(&slot->state, STATE_PARKED);
+  eeprom_write_byte(&slot->seq, ++current_seq);
+  parked = true;
+}
+}  // end namespace PositionStore
+
+// Counters for finding out what goes wrong in the field, kept across power
+// cycles: in RAM while running, mirrored to EEPROM whenever the screen
+// stops. On request, sent as a burst over the LED pin; see README.
+#if DIAGNOSTICS
+namespace Diagnostics {
+static const byte_t VERSION = 4;   // Change with the layout.
+static const unsigned long BAUD = 19200;
+
+// Only shorts and bytes, in this order, to have the same layout on the
+// host, where shorts are aligned.
+struct Stats {
+  unsigned short moves;
+  unsigned short move_ticks;        // Of the last move.
+  Clock::cycle_t min_tick_period;   // While running, after the soft start.
+  Clock::cycle_t max_tick_period;
+  Clock::cycle_t max_loop_cycles;   // Longest main loop pass.
+  unsigned short ir_rejected;       // Frames with wrong address or checksum.
+  unsigned short ir_timeouts;       // Transmissions that stopped midway.
+  unsigned short encoder_glitches;  // Edges rejected while moving.
+  byte_t errors[5];                 // Per Screen::ErrorType, but ERR_NONE.
+  signed char home_error;           // Count at the endswitch, last time.
+  signed char drift;                // Learned correction, 1/256 per tick.
+  byte_t boots;
+  byte_t version;
+};
+static Stats stats;
+static Stats eeprom_stats EEMEM;
+
+template <typename T> static void add(T *counter, unsigned short n) {
+  const T before = *counter;
+  *counter += n;
+  if (*counter < before)
+    *counter = (T) ~0;
+}
+
+static void reset() {
+  for (byte_t i = 0; i < sizeof(stats); ++i)
+    ((byte_t*) &stats)[i] = 0;
+  stats.min_tick_period = 0xFFFF;
+  stats.version = VERSION;
+}
+
+static void init() {
+  eeprom_read_block(&stats, &eeprom_stats, sizeof(stats));
+  if (stats.version != VERSION)
+    reset();   // Erased or older layout.
+  add(&stats.boots, 1);
+  eeprom_update_byte(&eeprom_stats.boots, stats.boots);
+}
+
+static void save() {
+  eeprom_update_block(&stats, &eeprom_stats, sizeof(stats));
+}
+
+static void tick_period(Clock::cycle_t period) {
+  if (period < stats.min_tick_period) stats.min_tick_period = period;
+  if (period > stats.max_tick_period) stats.max_tick_period = period;
+}
+
+static void loop_cycles(Clock::cycle_t cycles) {
+  if (cycles > stats.max_loop_cycles) stats.max_loop_cycles = cycles;
+}
+
+static void move_done(unsigned short ticks, byte_t glitches) {
+  add(&stats.moves, 1);
+  stats.move_ticks = ticks;
+  add(&stats.encoder_glitches, glitches);
+}
+
+static void error(byte_t type) { add(&stats.errors[type - 1], 1); }
+static void ir_rejected() { add(&stats.ir_rejected, 1); }
+static void ir_timeout() { add(&stats.ir_timeouts, 1); }
+static void drift(signed char drift) { stats.drift = drift; }
+
+static void home_error(short error) {
+  stats.home_error = error < -127 ? -127 : (error > 127 ? 127 : error);
+}
+
+// One byte, LSB first. Delays minus the time the loop takes.
+static void send(byte_t b) {
+  static constexpr double BIT_US = 1e6 / BAUD - 12 * 1e6 / F_CPU;
+  StatusLed::write(false);   // Start bit.
+  _delay_us(BIT_US);
+  for (byte_t i = 0; i < 8; ++i) {
+    StatusLed::write(b & 1);
+    b >>= 1;
+    _delay_us(BIT_US);
+  }
+  StatusLed::write(true);    // Stop bit.
+  _delay_us(BIT_US);
+}
+
+// The stats block, followed by the sum of its bytes. With interrupts off
+// for ~12ms, so only while the screen stands still.
+static void dump() {
+  const byte_t sreg = SREG;
+  cli();
+  StatusLed::write(true);    // Idle for a frame, so that the receiver syncs.
+  _delay_us(10 * 1e6 / BAUD);
+  byte_t sum = 0;
+  // Up to the version; on the host, padding follows it.
+  for (byte_t i = 0; i <= offsetof(Stats, version); ++i) {
+    const byte_t b = ((const byte_t*) &stats)[i];
+    sum += b;
+    send(b);
+  }
+  send(sum);
+  StatusLed::restore();
+  SREG = sreg;
+}
+}  // end namespace Diagnostics
+#else
+// Same calls, doing nothing.
+namespace Diagnostics {
+static inline void init() {}
+static inline void save() {}
+static inline void tick_period(Clock::cycle_t) {}
+static inline void loop_cycles(Clock::cycle_t) {}
+static inline void move_done(unsigned short, byte_t) {}
+static inline void error(byte_t) {}
+static inline void ir_rejected() {}
+static inline void ir_timeout() {}
+static inline void drift(signed char) {}
+static inline void home_error(short) {}
+static inline void dump() {}
+}  // end namespace Diagnostics
+#endif
+
+// If the main loop doesn't come by for 250ms, the watchdog interrupt
+// switches the motor off; if it still hangs, the next timeout resets the
+// chip. The state of the screen survives that in .noinit, so after the
+// reset we carry on right away instead of homing. Only once though: if it
+// hangs again before the next clean stop, it stays stopped.
+namespace Watchdog {
+static const byte_t MAX_RESUMES = 1;   // Without a clean stop in between.
+
+// Written by the main loop on each pass. Only valid if the check byte fits,
+// as after power-up, RAM has random content.
+struct ResumeState {
+  short pos;
+  short target;
+  byte_t dir;
+  byte_t error;
+  byte_t resets;   // Watchdog resets since the last clean stop.
+  byte_t check;
+};
+static ResumeState resume __attribute__((section(".noinit")));
+
+static bool was_reset;   // Last reset came from the watchdog.
+
+// Over the bytes before the check; on the host, padding follows it.
+static byte_t checksum(const ResumeState &state) {
+  byte_t sum = 0x5A;
+  for (byte_t i = 0; i < offsetof(ResumeState, check); ++i)
+    sum += ((const byte_t*) &state)[i];
+  return sum;
+}
+
+static void start() {
+  wdt_enable(WDTO_250MS);
+  WDTCSR |= (1<<WDIE);   // Interrupt first, reset only on the next timeout.
+}
+
+// The motor is off, nothing to guard. And there is no timer to wake us.
+static void stop() { wdt_disable(); }
+
+// The main loop still runs. The interrupt clears WDIE, so arm it again.
+static inline void kick() {
+  wdt_reset();
+  WDTCSR |= (1<<WDIE);
+}
+
+// First thing after reset: after a watchdog reset, it keeps running with
+// the shortest timeout.
+static void init() {
+  was_reset = (MCUSR & (1<<WDRF)) != 0;
+  MCUSR = 0;
+  if (!was_reset || resume.check != checksum(resume))
+    resume.resets = 0;   // Nothing to go by; save() makes it valid.
+  start();
+}
+
+static void save(short pos, short target, byte_t dir, byte_t error) {
+  resume.pos = pos;
+  resume.target = target;
+  resume.dir = dir;
+  resume.error = error;
+  resume.check = checksum(resume);
+}
+
+// After a watchdog reset with a valid state, returns it, this reset
+// counted in. Only once.
+static const ResumeState *take() {
+  if (!was_reset || resume.check != checksum(resume))
+    return 0;
+  was_reset = false;
+  if (resume.resets != 0xFF)
+    ++resume.resets;
+  resume.check = checksum(resume);
+  return &resume;
+}
+
+// The screen stopped where it should: earlier resets don't count anymore.
+static void clean_stop() {
+  resume.resets = 0;
+  resume.check = checksum(resume);
+}
+}  // end namespace Watchdog
+
+// Programmable preset low positions of the screen, e.g. one per aspect
+// ratio. Erased EEPROM reads as -1, which is not plausible, so we fall back
+// to the full length.
+enum { PRESET_COUNT = 3 };
+static short eeprom_presets[PRESET_COUNT] EEMEM;
+static byte_t eeprom_drift EEMEM;   // Screen::drift_ + DRIFT_OFFSET.
+
+// The encoder wheel can't physically turn faster than this. Edges closer
+// together are glitches, e.g. from EMI of the motor at start-up.
+static const unsigned short ENCODER_MAX_TICKS_PER_SECOND = 100;
+static const Clock::cycle_t ENCODER_MIN_PERIOD =
+  Clock::Micros<1000000UL / ENCODER_MAX_TICKS_PER_SECOND>::cycles;
+
 class Screen {
 private:
   static const short SCREEN_UP_STOP_THRESHOLD =  -4;
-  static const short SCREEN_DN_STOP_THRESHOLD = 258;
+  static const short SCREEN_DN_STOP_THRESHOLD = 258;  // Full length.
+
+  // Soft start: one duty cycle step every 2ms. Soft stop over 16 ticks.
+  // After starting, it takes a few ticks until the average tick period is
+  // good enough for the stall detection.
+  enum {
+    RAMP_UP_STEP_CYCLES = Clock::Micros<2000>::cycles,
+    RAMP_DOWN_TICKS = 16,
+    STALL_SETTLE_TICKS = 4,
+  };
+#if SYNC_BUS == SYNC_FOLLOWER
+  // Following the master: the duty cycle goes down this much each tick
+  // that is faster than the master's, up for each slower one.
+  enum { LEAD_DUTY_STEP = 8, FOLLOW_SLACK = 2 };
+#endif
+  // The soft start is timed with the 16 bit clock.
+  static_assert((unsigned long) (MotorPwm::MAX_DUTY - MotorPwm::MIN_DUTY)
+                * RAMP_UP_STEP_CYCLES <= 0xFFFF,
+                "Soft start too long for the 16 bit clock; use a larger "
+                "CLOCK_PRESCALER");
+
+  // Drift correction: how many ticks the count is off at the endswitch
+  // after a round trip, in 1/256 per tick travelled down. Only learned
+  // after enough travel; anything further off than MAX_HOME_ERROR is not
+  // drift but a slipping wheel or the like.
+  enum {
+    MIN_DRIFT_TICKS = 64,
+    MAX_HOME_ERROR = 16,
+    MAX_DRIFT = 32,       // 1/8 tick per tick.
+    DRIFT_OFFSET = 64,    // Erased EEPROM is out of range.
+  };
 
 public:
   enum Direction {
@@ -90,52 +698,103 @@ public:
   enum ErrorType {
     ERR_NONE,
     ERR_SWITCH,
-    ERR_ROTATION
+    ERR_ROTATION,   // No ticks from the start.
+    ERR_STALL,      // Ticks stopped while running.
+    ERR_GLITCHES,   // Encoder signal too noisy to trust.
+    ERR_WATCHDOG    // Hung again after resuming from a watchdog reset.
   };
-  Screen() : error_(ERR_NONE), motor_dir_(DIR_NEUTRAL), pos_(0) {
-    /* nop */
+#if DIAGNOSTICS
+  static_assert(ERR_WATCHDOG <= sizeof(Diagnostics::Stats::errors),
+                "Diagnostics need a counter per error");
+#endif
+  Screen() : error_(ERR_NONE), motor_dir_(DIR_NEUTRAL), pos_(0),
+             homed_(false), up_limit_(SCREEN_UP_STOP_THRESHOLD),
+             down_ticks_(0), drift_acc_(0),
+             tick_period_(0), run_ticks_(0), coast_dir_(DIR_NEUTRAL),
+#if SYNC_BUS == SYNC_FOLLOWER
+             lead_period_(0), lead_duty_(MotorPwm::MAX_DUTY),
+#endif
+             preset_(0) {
+    coast_k_[0] = coast_k_[1] = 0;
+    drift_ = eeprom_read_byte(&eeprom_drift) - DRIFT_OFFSET;
+    if (drift_ < -MAX_DRIFT || drift_ > MAX_DRIFT)
+      drift_ = 0;
+    Diagnostics::drift(drift_);
+    for (byte_t i = 0; i < PRESET_COUNT; ++i) {
+      presets_[i] =
+        (short) eeprom_read_word((const uint16_t*) &eeprom_presets[i]);
+      if (presets_[i] <= 0 || presets_[i] > SCREEN_DN_STOP_THRESHOLD)
+        presets_[i] = SCREEN_DN_STOP_THRESHOLD;
+    }
+    target_ = SCREEN_UP_STOP_THRESHOLD;
   }
 
-  // Go to the other endpos (if down, go up, if up, go down), if not
-  // already running
+  // Go to the other endpos (if up, go down to the first preset, otherwise
+  // go up), if not already running. While on the way down, go on to the
+  // next preset instead; that way, each preset is reached in one move.
   void toggle_screen_pos() {
+    if (motor_dir_ == DIR_DOWN) {
+      // Next preset. If we're past it already, stop instead of reversing
+      // in the middle of the move; ON doesn't reverse going up either.
+      const byte_t next = preset_ + 1 < PRESET_COUNT ? preset_ + 1 : 0;
+      if (presets_[next] > pos_) {
+        go_to_preset(next);
+      } else {
+        preset_ = next;
+        set_dir(DIR_NEUTRAL);
+      }
+      return;
+    }
     if (motor_dir_ != DIR_NEUTRAL)
       return;
-    if (up_stop_condition())
-      set_dir(DIR_DOWN);
-    else if (down_stop_condition())
+    if (error_ || pos_ <= 0 || endswitch_in())
+      go_to_preset(0);
+    else
       set_dir(DIR_UP);
   }
 
-  // Set motor to given direction, but honor endpositions.
+  // Set motor to given direction, but honor endpositions. Going up stops
+  // at the endswitch, going down at the current preset.
   void set_dir(Direction d) {
-    if (d == motor_dir_)
-      return;
-    // We're connected to two output ports for layout reasons, hence two
-    // IO-operations per direction. We only switch the motor on if we're
-    // within limits.
-    switch (d) {
-    case DIR_UP:
-      if (!up_stop_condition()) {
-        PORTA &= ~OUT_MOT_DN_A;
-        PORTB |=  OUT_MOT_UP_B;
-        motor_dir_ = d;
-        last_update_time_ = Clock::now();
-      }
-      break;
-    case DIR_DOWN:
-      if (!down_stop_condition()) {
-        PORTA |=  OUT_MOT_DN_A;
-        PORTB &= ~OUT_MOT_UP_B;
-        motor_dir_ = d;
-        last_update_time_ = Clock::now();
-      }
-      break;
-    default:
-      PORTA &= ~OUT_MOT_DN_A;
-      PORTB &= ~OUT_MOT_UP_B;
-      motor_dir_ = d;
-    }
+    target_ = (d == DIR_DOWN) ? presets_[preset_] : SCREEN_UP_STOP_THRESHOLD;
+    set_dir_internal(d);
+  }
+
+  // Like set_dir(), but going down only stops at the full length of the
+  // screen. For manually finding a new preset position.
+  void set_dir_manual(Direction d) {
+    target_ = (d == DIR_DOWN) ? SCREEN_DN_STOP_THRESHOLD
+      : SCREEN_UP_STOP_THRESHOLD;
+    set_dir_internal(d);
+  }
+
+  // Move to the given position. The direction depends on where we are.
+  void go_to(short target) {
+    if (target > SCREEN_DN_STOP_THRESHOLD)
+      target = SCREEN_DN_STOP_THRESHOLD;
+    target_ = target;
+    if (pos_ < target)
+      set_dir_internal(DIR_DOWN);
+    else if (pos_ > target)
+      set_dir_internal(DIR_UP);
+    else
+      set_dir_internal(DIR_NEUTRAL);
+  }
+
+  // Select the preset and go there.
+  void go_to_preset(byte_t preset) {
+    preset_ = preset;
+    go_to(presets_[preset]);
+  }
+
+  // Program the current position for the last selected preset. Needs to
+  // be stopped somewhere below the home position.
+  bool program_preset() {
+    if (motor_dir_ != DIR_NEUTRAL || error_ || pos_ <= 0)
+      return false;
+    presets_[preset_] = pos_;
+    eeprom_write_word((uint16_t*) &eeprom_presets[preset_], pos_);
+    return true;
   }
 
   // Set the screen in motion towards home position if not already reached.
@@ -150,44 +809,110 @@ public:
     // length of the screen. In this case we actually rely on the endswitch
     // working properly because the negative position check might be late.
     pos_ = SCREEN_DN_STOP_THRESHOLD;
+    homed_ = false;
     set_dir(DIR_UP);
   }
 
-  // Outside event: a tick from the rotation encoder. Updates position.
-  void event_rotation_tick() volatile {
-    last_update_time_ = Clock::now();
-    switch (motor_dir_) {
+  // Outside event: a tick from the rotation encoder at 'time'. Updates
+  // position and the estimate of the time between ticks. After the motor is
+  // switched off, the screen still coasts for a few ticks.
+  // The direction is only known with a quadrature encoder; otherwise it is
+  // DIR_NEUTRAL and we assume the direction we're driving.
+  void event_rotation_tick(Clock::cycle_t time, Direction dir) {
+    const Clock::cycle32_t now = Clock::now32();
+    // The precise tick time is only 16 bit; if it has been longer than
+    // that, the exact value doesn't matter for the estimate.
+    const Clock::cycle_t period = (now - last_update_time_ > 0xFFFF)
+      ? 0xFFFF : time - last_tick_time_;
+    last_update_time_ = now;
+#if QUADRATURE_ENCODER
+    // Glitches are counted, see encoder_a_changed(), but they say nothing
+    // about the speed; they would make the stall timeout far too short.
+    const bool glitch = period < ENCODER_MIN_PERIOD;
+    if (!glitch)
+      last_tick_time_ = time;
+#else
+    last_tick_time_ = time;
+#endif
+    if (dir == DIR_NEUTRAL) {
+      dir = motor_dir_ != DIR_NEUTRAL ? motor_dir_ : coast_dir_;
+    } else if (motor_dir_ == DIR_NEUTRAL && coast_dir_ == DIR_NEUTRAL) {
+      // Moved by hand. Count as moving until it stands still again, but
+      // there is nothing to learn about coasting.
+      coast_dir_ = dir;
+      coast_ticks_ = 0;
+      stop_period_ = 0;
+    }
+    switch (dir) {
     case DIR_UP:
       --pos_;
       break;
     case DIR_DOWN:
       ++pos_;
+      correct_drift();
       break;
     default:
-      ;
+      return;
+    }
+#if QUADRATURE_ENCODER
+    if (glitch)
+      return;
+#endif
+    if (motor_dir_ != DIR_NEUTRAL) {
+      // The first period after start doesn't say much about the previous
+      // move, so start the average fresh.
+      if (run_ticks_ == 0)
+        tick_period_ = period;
+      else
+        tick_period_ = tick_period_ - (tick_period_ >> 2) + (period >> 2);
+      if (run_ticks_ >= STALL_SETTLE_TICKS) {
+        Diagnostics::tick_period(period);
+        if (full_duty_ && (fastest_period_ == 0
+                           || tick_period_ < fastest_period_))
+          fastest_period_ = tick_period_;
+      }
+#if SYNC_BUS == SYNC_FOLLOWER
+      if (lead_period_ != 0 && run_ticks_ >= STALL_SETTLE_TICKS)
+        adjust_lead_duty(period);
+#endif
+      if (run_ticks_ != 0xFF)
+        ++run_ticks_;
+    } else if (dir == coast_dir_) {
+      ++coast_ticks_;
     }
   }
 
   // Outside event: endswitch is triggered. Updates position.
+  // Whatever the count is now tells how far off it got since the last time
+  // here; learn from that.
   void event_endswitch_triggered()  {
     if (motor_dir_ != DIR_DOWN) {
+      if (homed_ && down_ticks_ >= MIN_DRIFT_TICKS)
+        learn_drift(pos_);
       pos_ = 0;
+      homed_ = true;
+      up_limit_ = SCREEN_UP_STOP_THRESHOLD;
+      down_ticks_ = 0;
+      drift_acc_ = 0;
     }
   }
 
   // Check stop conditions and stops motor if so.
   // This method must be called regularly.
   void check_stop_conditions() {
-    // We need to make sure not to be interrupted by the rotation switch
-    // otherwise 16-bit numbers are mixed up.
-    cli();
     if (motor_dir_ != DIR_NEUTRAL
-        && Clock::now() - last_update_time_ > Clock::ms_to_cycles(1000)) {
+        && Clock::now32() - last_update_time_ > stall_timeout()) {
       // Wheel encoder failed or motor stuck: haven't received
-      // a tick for some time.
-      enter_error_state(ERR_ROTATION);
+      // a tick for some time. If it had been running, that's a stall;
+      // otherwise the encoder probably doesn't see the wheel.
+      enter_error_state(run_ticks_ >= STALL_SETTLE_TICKS
+                        ? ERR_STALL : ERR_ROTATION);
     }
-    if (motor_dir_ == DIR_UP && pos_ <= SCREEN_UP_STOP_THRESHOLD) {
+    if (motor_dir_ != DIR_NEUTRAL && slowed_down()) {
+      // Still ticking, but getting stuck gradually.
+      enter_error_state(ERR_STALL);
+    }
+    if (motor_dir_ == DIR_UP && pos_ <= up_limit_) {
       // Endswitch failed. We're up beyond home position.
       enter_error_state(ERR_SWITCH);
     }
@@ -196,41 +921,521 @@ public:
         || (motor_dir_ == DIR_DOWN && down_stop_condition())) {
       set_dir(DIR_NEUTRAL);
     }
-    sei();
+    if (motor_dir_ != DIR_NEUTRAL)
+      update_speed();
+
+    if (coast_dir_ != DIR_NEUTRAL
+        && Clock::now32() - last_update_time_ > Clock::Cycles<300>::value) {
+      // Came to a halt. Learn how far we went since switching off.
+      if (!error_)
+        learn_coast_distance();
+      coast_dir_ = DIR_NEUTRAL;
+    }
   }
 
   inline ErrorType error() const { return error_; }
+  inline bool is_moving() const {
+    return motor_dir_ != DIR_NEUTRAL || coast_dir_ != DIR_NEUTRAL;
+  }
+  inline short position() const { return pos_; }
+
+#if SYNC_BUS == SYNC_MASTER
+  // For the followers: where we're going, or standing.
+  short destination() const {
+    return motor_dir_ != DIR_NEUTRAL ? target_ : pos_;
+  }
+  // Once the soft start is over; 0 while not running.
+  Clock::cycle_t running_period() const {
+    return (motor_dir_ != DIR_NEUTRAL && run_ticks_ >= STALL_SETTLE_TICKS)
+      ? tick_period_ : 0;
+  }
+#endif
+
+#if SYNC_BUS == SYNC_FOLLOWER
+  // From the master on the sync bus: go where it goes, not faster than it
+  // runs. Standing, a few ticks difference is not worth a move.
+  void follow(short target, Clock::cycle_t period) {
+    lead_period_ = period;
+    if (motor_dir_ == DIR_NEUTRAL && pos_ - target <= FOLLOW_SLACK
+        && target - pos_ <= FOLLOW_SLACK)
+      return;
+    go_to(target);
+  }
+#endif
+
+  // Take the position from a previous life instead of homing. Returns false
+  // if that doesn't look plausible.
+  bool restore_position(short pos) {
+    if (pos < SCREEN_UP_STOP_THRESHOLD || pos > SCREEN_DN_STOP_THRESHOLD)
+      return false;
+    pos_ = pos;
+    return true;
+  }
+
+  // For carrying on after a watchdog reset.
+  void save_state() const {
+    Watchdog::save(pos_, target_, motor_dir_, error_);
+  }
+
+  // Carry on where we were before the watchdog reset. Returns false if the
+  // state doesn't look plausible. If the last reset was one too many, the
+  // motor stays off: whatever hung would likely just hang again.
+  bool resume(const Watchdog::ResumeState &state) {
+    if (!restore_position(state.pos) || state.dir > DIR_DOWN
+        || state.error > ERR_WATCHDOG)
+      return false;
+    // Ticks since the last pass before the reset weren't counted. Up to the
+    // endswitch, give it the slack of a bad homing.
+    up_limit_ = SCREEN_UP_STOP_THRESHOLD - MAX_HOME_ERROR;
+    if (state.resets > Watchdog::MAX_RESUMES) {
+      error_ = ERR_WATCHDOG;
+      Diagnostics::error(ERR_WATCHDOG);
+      return true;
+    }
+    error_ = (ErrorType) state.error;
+    target_ = state.target;
+    set_dir_internal((Direction) state.dir);
+    return true;
+  }
+
+  // Outside event: too many glitches on the encoder during this move. The
+  // position can't be trusted anymore.
+  void event_glitch_storm() {
+    if (motor_dir_ != DIR_NEUTRAL)
+      enter_error_state(ERR_GLITCHES);
+  }
 
 private:
+  // Once running, a tick that takes STALL_FACTOR times the average period
+  // means the motor is slowing down hard, i.e. stuck. Until we know the
+  // speed and at most, wait 1 second.
+  Clock::cycle32_t stall_timeout() const {
+    const Clock::cycle32_t limit = Clock::Cycles<1000>::value;
+    if (run_ticks_ < STALL_SETTLE_TICKS)
+      return limit;
+    const Clock::cycle32_t timeout = (Clock::cycle32_t) STALL_FACTOR
+      * tick_period_;
+    return timeout < limit ? timeout : limit;
+  }
+
+  // The average follows a gradual slowdown, so the timeout only sees a
+  // sudden one. At full duty, a tick also mustn't take STALL_FACTOR times
+  // the fastest average of this move; with less, e.g. in the soft stop,
+  // the motor is supposed to be slower.
+  bool slowed_down() const {
+    return full_duty_ && fastest_period_ != 0
+      && Clock::now32() - last_update_time_
+         > (Clock::cycle32_t) STALL_FACTOR * fastest_period_;
+  }
+
+  // Going up to home, the endswitch is the stop, so no early stop there.
   inline bool up_stop_condition() {
-    return error_ || pos_ <= SCREEN_UP_STOP_THRESHOLD || endswitch_in();
+    if (error_ || endswitch_in())
+      return true;
+    if (target_ <= SCREEN_UP_STOP_THRESHOLD)
+      return pos_ <= up_limit_;
+    return pos_ - expected_coast(0) <= target_;
   }
 
   inline bool down_stop_condition() {
-    return error_ || pos_ >= SCREEN_DN_STOP_THRESHOLD;
+    return error_ || pos_ + expected_coast(1) >= target_;
+  }
+
+  // The distance the screen coasts after switching off the motor is
+  // roughly proportional to the speed, i.e. inversely proportional to the
+  // tick period. We learn the factor per direction (0: up, 1: down) and
+  // stop early by the expected number of ticks.
+  short expected_coast(byte_t dir_index) {
+    const Clock::cycle_t k = coast_k_[dir_index];
+    const Clock::cycle_t period = tick_period_;
+    if (k == 0 || period == 0)
+      return 0;
+    return ((unsigned long) k + period / 2) / period;  // Rounding can wrap.
+  }
+
+  // Soft start and soft stop: ramp up the duty cycle with the time since
+  // start, and down again over the last ticks before the target. Going home,
+  // we slow down towards position 0 where we expect the endswitch.
+  void update_speed() {
+    if (ramp_up_duty_ < MotorPwm::MAX_DUTY) {
+      const unsigned short duty = MotorPwm::MIN_DUTY
+        + (Clock::cycle_t) (Clock::now() - start_time_) / RAMP_UP_STEP_CYCLES;
+      ramp_up_duty_ = duty < MotorPwm::MAX_DUTY ? duty : MotorPwm::MAX_DUTY;
+    }
+    short remaining = (motor_dir_ == DIR_DOWN)
+      ? target_ - pos_
+      : pos_ - (target_ > 0 ? target_ : 0);
+    byte_t duty = ramp_up_duty_;
+    if (remaining < RAMP_DOWN_TICKS) {
+      if (remaining < 0) remaining = 0;
+      const byte_t ramp_down_duty = MotorPwm::MIN_DUTY
+        + (remaining * (MotorPwm::MAX_DUTY - MotorPwm::MIN_DUTY))
+        / RAMP_DOWN_TICKS;
+      if (ramp_down_duty < duty)
+        duty = ramp_down_duty;
+    }
+#if SYNC_BUS == SYNC_FOLLOWER
+    if (lead_period_ != 0 && lead_duty_ < duty)
+      duty = lead_duty_;
+#endif
+    full_duty_ = duty == MotorPwm::MAX_DUTY;
+    MotorPwm::set(duty);
+  }
+
+#if SYNC_BUS == SYNC_FOLLOWER
+  void adjust_lead_duty(Clock::cycle_t period) {
+    if (period < lead_period_) {
+      lead_duty_ = (lead_duty_ > MotorPwm::MIN_DUTY + LEAD_DUTY_STEP)
+        ? lead_duty_ - LEAD_DUTY_STEP : MotorPwm::MIN_DUTY;
+    } else {
+      lead_duty_ = (lead_duty_ < MotorPwm::MAX_DUTY - LEAD_DUTY_STEP)
+        ? lead_duty_ + LEAD_DUTY_STEP : MotorPwm::MAX_DUTY;
+    }
+  }
+#endif
+
+  void learn_coast_distance() {
+    if (stop_period_ == 0)
+      return;  // Wasn't the motor that moved us.
+    unsigned long k = (unsigned long) coast_ticks_ * stop_period_;
+    if (k > 0xFFFF) k = 0xFFFF;
+    Clock::cycle_t *learned = &coast_k_[coast_dir_ == DIR_DOWN];
+    *learned = (*learned == 0) ? k : (3UL * *learned + k) / 4;
+  }
+
+  void set_dir_internal(Direction d) {
+    if (d == motor_dir_)
+      return;
+    // We're connected to two output ports for layout reasons, hence two
+    // IO-operations per direction. We only switch the motor on if we're
+    // within limits.
+    switch (d) {
+    case DIR_UP:
+      if (!up_stop_condition()) {
+        PORTA &= ~OUT_MOT_DN_A;
+        MOT_UP_PORT |=  OUT_MOT_UP;
+        motor_dir_ = d;
+        start_motor();
+      }
+      break;
+    case DIR_DOWN:
+      if (!down_stop_condition()) {
+        PORTA |=  OUT_MOT_DN_A;
+        MOT_UP_PORT &= ~OUT_MOT_UP;
+        motor_dir_ = d;
+        start_motor();
+      }
+      break;
+    default:
+      MotorPwm::off();
+      PORTA &= ~OUT_MOT_DN_A;
+      MOT_UP_PORT &= ~OUT_MOT_UP;
+      // Count the ticks while coasting to a halt.
+      coast_dir_ = motor_dir_;
+      coast_ticks_ = 0;
+      stop_period_ = tick_period_;
+      last_tick_time_ = Clock::now();
+      last_update_time_ = Clock::now32();
+      motor_dir_ = d;
+      return;
+    }
+    if (motor_dir_ != DIR_NEUTRAL)
+      coast_dir_ = DIR_NEUTRAL;  // Motor on again.
+  }
+
+  // Motor just got a direction. Start slowly (also when reversing).
+  void start_motor() {
+    start_time_ = last_tick_time_ = Clock::now();
+    last_update_time_ = Clock::now32();
+    run_ticks_ = 0;
+    fastest_period_ = 0;
+    full_duty_ = false;
+    ramp_up_duty_ = MotorPwm::MIN_DUTY;
+#if SYNC_BUS == SYNC_FOLLOWER
+    lead_duty_ = MotorPwm::MAX_DUTY;
+#endif
+    MotorPwm::on(MotorPwm::MIN_DUTY);
+  }
+
+  // Ticks going down count drift_/256 less. Spread out, every so many ticks
+  // one.
+  void correct_drift() {
+    if (down_ticks_ != 0x7FFF)
+      ++down_ticks_;
+    drift_acc_ += drift_;
+    if (drift_acc_ >= 256) {
+      drift_acc_ -= 256;
+      --pos_;
+    } else if (drift_acc_ <= -256) {
+      drift_acc_ += 256;
+      ++pos_;
+    }
+  }
+
+  // At the endswitch, the count should be 0; 'error' is what it is. Half of
+  // the rest goes into the correction, so a single odd trip doesn't throw
+  // it off. Whether the ticks were miscounted on the way down or up can't
+  // be told apart; it matters for the stop positions going down, so that's
+  // where it goes.
+  void learn_drift(short error) {
+    Diagnostics::home_error(error);
+    if (error < -MAX_HOME_ERROR || error > MAX_HOME_ERROR)
+      return;
+    short drift = drift_ + (short) (error * 256L / down_ticks_) / 2;
+    if (drift < -MAX_DRIFT) drift = -MAX_DRIFT;
+    if (drift > MAX_DRIFT) drift = MAX_DRIFT;
+    if (drift != drift_) {
+      drift_ = drift;
+      eeprom_write_byte(&eeprom_drift, drift_ + DRIFT_OFFSET);
+    }
+    Diagnostics::drift(drift_);
   }
 
   void enter_error_state(ErrorType type) {
     set_dir(DIR_NEUTRAL);
     error_ = type;
+    Diagnostics::error(type);
   }
 
   ErrorType error_;
   Direction motor_dir_;
-  volatile short pos_;  // volatile, because updated in ISR.
-  volatile Clock::cycle_t last_update_time_;
+  short pos_;
+  bool homed_;                       // Been at the endswitch since boot.
+  short up_limit_;                   // Further up, the endswitch failed.
+  short down_ticks_;                 // Counted going down since then.
+  short drift_acc_;                  // Drift correction, 1/256 ticks.
+  signed char drift_;                // Correction, 1/256 per tick down.
+  Clock::cycle32_t last_update_time_;  // Last tick or motor change.
+  Clock::cycle_t last_tick_time_;      // Precise time of the last tick.
+  Clock::cycle_t tick_period_;       // Running average while motor on.
+  Clock::cycle_t fastest_period_;    // Of the average at full duty; 0: none.
+  bool full_duty_;                   // Motor driven with MAX_DUTY.
+  byte_t run_ticks_;                 // Ticks since motor start, saturating.
+  Direction coast_dir_;              // Direction we're coasting after stop.
+  byte_t coast_ticks_;               // Ticks since motor was switched off.
+  Clock::cycle_t stop_period_;       // Tick period when switched off.
+  Clock::cycle_t coast_k_[2];        // coast ticks * period (up, down)
+  Clock::cycle_t start_time_;        // Motor switched on.
+  byte_t ramp_up_duty_;              // Duty cycle of the soft start.
+#if SYNC_BUS == SYNC_FOLLOWER
+  Clock::cycle_t lead_period_;       // Of the master; 0: not running.
+  byte_t lead_duty_;                 // At most, to keep up with it.
+#endif
+  short target_;    // Where the current movement stops.
+  byte_t preset_;   // Last selected preset.
+  short presets_[PRESET_COUNT];
+};
+
+#if QUADRATURE_ENCODER
+// Quadrature decoding of the two encoder channels: A from the comparator
+// or ADC, B on A5. State is A << 1 | B, the table is indexed by the
+// previous and the new state. Only transitions of channel A count, so that
+// the position has the same unit as with a single channel; transitions of
+// B just update the state. Impossible transitions (both changed) count
+// nothing.
+// If it counts the wrong way round, swap the sensors.
+static const signed char quadrature_steps[16] PROGMEM = {
+  /* 00 -> */  0,  0, -1,  0,
+  /* 01 -> */  0,  0,  0, +1,
+  /* 10 -> */ +1,  0,  0,  0,
+  /* 11 -> */  0, -1,  0,  0,
 };
+static byte_t quadrature_state;
+
+static void quadrature_update(bool a) {
+  const byte_t state = (a << 1) | ((PINA & IN_ENCODER2_A) != 0);
+  const signed char step =
+    pgm_read_byte(&quadrature_steps[(quadrature_state << 2) | state]);
+  quadrature_state = state;
+  if (step > 0)
+    EventQueue::push(EventQueue::ROTATION_TICK_DOWN, Clock::now());
+  else if (step < 0)
+    EventQueue::push(EventQueue::ROTATION_TICK_UP, Clock::now());
+}
+#endif
+
+// More rejected edges than this in one move: something is badly wrong.
+static const byte_t ENCODER_GLITCH_STORM = 64;
+
+// Level of encoder channel A; from the comparator or sampled by the ADC.
+// Only touched in interrupt handlers.
+static bool encoder_a = true;
+static Clock::cycle32_t encoder_last_edge;
+static volatile byte_t encoder_edges;     // Saturating count, for calibration.
+static volatile byte_t encoder_move_glitches;  // Rejected edges, this move.
+
+// Returns whether the edge was taken; the caller only updates its trigger
+// state then.
+static bool encoder_a_changed(bool level) {
+  if (level == encoder_a)
+    return false;
+  // A glitch is a pair of edges. The first one is taken, as it can't be
+  // told from a real edge yet; the second comes too soon and is rejected.
+  // The level then stays, so the next real edge, back to that level, is
+  // ignored: the spike only moved that edge earlier. The quadrature decoder
+  // on the other hand counts a spike back and forth, so it cancels out by
+  // itself; there, dropping an edge would make it count wrong.
+  const Clock::cycle32_t now = Clock::now32();
+  if (now - encoder_last_edge < ENCODER_MIN_PERIOD) {
+    if (encoder_move_glitches != 0xFF)
+      ++encoder_move_glitches;
+#if !QUADRATURE_ENCODER
+    return false;
+#endif
+  }
+  encoder_last_edge = now;
+  encoder_a = level;
+  if (encoder_edges != 0xFF)
+    ++encoder_edges;
+#if QUADRATURE_ENCODER
+  quadrature_update(level);
+#else
+  EventQueue::push(EventQueue::ROTATION_TICK, now);
+#endif
+  return true;
+}
+
+// Schmitt trigger for the wheel encoder in software. The comparator with
+// the fixed bias divider only works as long as the signal of the CNY70
+// stays where it was when the resistors were chosen; aging or ambient light
+// shift it. So while moving, we sample the sensor with the ADC as well.
+//
+// Calibration: while the comparator still generates the ticks, we record
+// the lowest and highest level seen during a move. From then on, we use
+// the ADC samples instead, with thresholds around the midpoint of the
+// learned levels, which keep adapting to the extremes seen in each stripe.
+// If we lose the signal that way, we go back to the comparator and
+// calibrate again.
+namespace WheelSensor {
+enum {
+  MIN_SPAN = 24,               // Of 255. Below: no usable signal.
+  MIN_CALIBRATION_EDGES = 16,  // Edges needed in a calibration move.
+};
+
+static byte_t eeprom_levels[2] EEMEM;  // Low, high. Erased: not valid.
+
+static volatile bool calibrated;  // Using ADC instead of comparator.
+
+// Only touched in the ADC interrupt while running.
+static byte_t low, high;          // Learned levels.
+static byte_t rise_threshold, fall_threshold;
+static bool phase;                // Of the signal, glitches included.
+static byte_t extreme;            // Of the current phase of the signal.
+static byte_t calibration_min, calibration_max;
+
+static void update_thresholds() {
+  const byte_t span = high - low;
+  const byte_t mid = low + span / 2;
+  rise_threshold = mid + span / 8;
+  fall_threshold = mid - span / 8;
+}
+
+static void use_adc() {
+  ACSR &= ~(1<<ACIE);
+  update_thresholds();
+  calibrated = true;
+}
+
+static void use_comparator() {
+  calibrated = false;
+  ACSR |= (1<<ACI);  // Clear stale interrupt flag.
+  ACSR |= (1<<ACIE);
+}
+
+// Start sampling. Called when the screen starts moving.
+static void start() {
+  calibration_min = 0xFF;
+  calibration_max = 0;
+  phase = encoder_a;
+  extreme = phase ? 0 : 0xFF;
+  encoder_edges = 0;
+  encoder_move_glitches = 0;
+  PRR &= ~(1<<PRADC);
+  ADMUX = (1<<MUX0);     // ADC1 == AIN0, reference Vcc.
+  ADCSRB = (1<<ADLAR);   // 8 bit are plenty. Free running.
+  // clk/128: ~4.8kHz sample rate at 8MHz, ~12kHz at 20MHz; 8 bit
+  // conversions are fine with the ADC clock up to the 156kHz of that.
+  ADCSRA = (1<<ADEN) | (1<<ADSC) | (1<<ADATE) | (1<<ADIE)
+    | (1<<ADPS2) | (1<<ADPS1) | (1<<ADPS0);
+}
+
+static void init() {
+  low = eeprom_read_byte(&eeprom_levels[0]);
+  high = eeprom_read_byte(&eeprom_levels[1]);
+  if (high > low && high - low >= MIN_SPAN)
+    use_adc();
+#if QUADRATURE_ENCODER
+  if (calibrated)
+    start();   // Need to follow manual moves all the time.
+#endif
+}
+
+// Stop sampling. Called when the screen stopped; lost_ticks if that was
+// because no ticks arrived anymore.
+static void stop(bool lost_ticks) {
+  if (calibrated && lost_ticks) {
+    // Our thresholds don't work anymore. Back to calibration.
+    eeprom_write_byte(&eeprom_levels[1], 0);
+    use_comparator();
+  }
+  if (!calibrated && encoder_edges >= MIN_CALIBRATION_EDGES
+      && calibration_max - calibration_min >= MIN_SPAN) {
+    low = calibration_min;
+    high = calibration_max;
+    eeprom_write_byte(&eeprom_levels[0], low);
+    eeprom_write_byte(&eeprom_levels[1], high);
+    use_adc();
+  }
+#if QUADRATURE_ENCODER
+  if (calibrated)
+    return;   // The ADC gives the ticks now, also of manual moves.
+#endif
+  ADCSRA = 0;
+  PRR |= (1<<PRADC);
+}
+
+// New sample from the ADC interrupt.
+static void sample(byte_t value) {
+  if (!calibrated) {
+    if (value < calibration_min) calibration_min = value;
+    if (value > calibration_max) calibration_max = value;
+    return;
+  }
+  if (phase) {
+    if (value > extreme) extreme = value;
+    if (value >= fall_threshold)
+      return;
+  } else {
+    if (value < extreme) extreme = value;
+    if (value <= rise_threshold)
+      return;
+  }
+  // Crossed the threshold: new phase. Like the comparator output, the phase
+  // follows the signal, glitches included, so that a spike ends where it
+  // started. Only a taken edge moves the learned levels, so a glitch doesn't
+  // drag the thresholds along.
+  phase = !phase;
+  if (encoder_a_changed(phase)) {
+    if (phase)
+      low = (3 * low + extreme) / 4;
+    else
+      high = (3 * high + extreme) / 4;
+    update_thresholds();
+  }
+  extreme = value;
+}
+}  // end namespace WheelSensor
+
+ISR(ADC_vect) {
+  WheelSensor::sample(ADCH);
+}
 
-static volatile Screen *global_screen; // ISR needs to access the screen.
 ISR(ANA_COMP_vect) {
-  static bool last = 0;
   const bool got_falling_edge = (ACSR & (1<<ACO)) == 0;
-  if (got_falling_edge != last) {
-    last = got_falling_edge;
-    global_screen->event_rotation_tick();
-  }
+  if (!encoder_a_changed(!got_falling_edge))
+    return;
 
-  // Schmitt-Trigger bias.
+  // Schmitt-Trigger bias; a glitch leaves it where it was.
   if (got_falling_edge) {
     PORTA |= OUT_STBIAS_A;  // just had a falling edge: apply positive bias.
   } else {
@@ -238,101 +1443,964 @@ ISR(ANA_COMP_vect) {
   }
 }
 
-static byte_t read_infrared(byte_t *buffer) {
-  // The infrared input is default high.
-  // A transmission starts with a long low phase (which triggered us to
-  // be in this routine in the first place), followed by a sequence of bits
-  // that are encoded in the duration of the high-phases. We interpret that as
-  // long == 1, short == 0. The end of the signal is reached once we see the
-  // high phase to be overly long (or: when 4 bytes are read).
-  // The timings were determined empirically.
-  byte_t read = 0;
-  byte_t current_bit = 0x80;
-  *buffer = 0;
-
-  // 8Mhz measurement: min=539 ; max=1500 in-between=1019 -> 127/Mhz
-  const unsigned short lo_hi_bit_threshold = 127 * AVR_MHZ;
-  const unsigned short end_of_signal = 1500 * AVR_MHZ;
-  unsigned short count = 0;
-
-  while (read < 4) {
-    while (!infrared_in()) {}  // skip low phase, wait for high.
-    for (count = 0; infrared_in() && count < end_of_signal; ++count)
-      ;
-    if (count >= end_of_signal)
-      break; // we're done - final high state.
-    if (count > lo_hi_bit_threshold) {
-      *buffer |= current_bit;
-    }
-    current_bit >>= 1;
-    if (!current_bit) {
-      current_bit = 0x80;
-      ++read;
-      if (read == 4)
+// Infrared receiver on A7/ICP, in two stages. The input capture unit of
+// Timer1 timestamps every edge of the TSOP output; the interrupt handler
+// only puts that into a ring buffer. The decoders in the main loop go
+// through the phases between the edges, one decoder per protocol, in
+// parallel.
+namespace InfraredEdges {
+// Time of each edge, with the level of the phase it ends in bit 0, so that
+// the decoders notice a missed edge. Costs one clock cycle of resolution.
+static const byte_t SIZE = 8;  // Power of two.
+static Clock::cycle_t edges[SIZE];
+static volatile byte_t head;   // Next to write. Only written by producer.
+static volatile byte_t tail;   // Next to read. Only written by consumer.
+static volatile Clock::cycle_t last_time;   // Of the newest edge.
+
+static inline bool empty() { return tail == head; }
+
+// Producer: interrupt handlers, or the main loop with interrupts disabled.
+// If the buffer is full, the edge is dropped; the decoders then see the
+// levels or durations not matching and reject the frame. Tells the main
+// loop if there was nothing to decode so far.
+static void push(bool was_high, Clock::cycle_t time) {
+  const byte_t h = head;
+  if ((byte_t)(h - tail) == SIZE)
+    return;
+  edges[h & (SIZE - 1)] = (time & ~1) | was_high;
+  EventQueue::barrier();
+  head = h + 1;
+  last_time = time;
+  if (h == tail)
+    EventQueue::push(EventQueue::INFRARED_RECEIVED, time);
+}
+
+// Consumer: main loop. Returns false if there is no edge.
+static bool pop(Clock::cycle_t *edge) {
+  const byte_t t = tail;
+  if (t == head)
+    return false;
+  EventQueue::barrier();
+  *edge = edges[t & (SIZE - 1)];
+  EventQueue::barrier();
+  tail = t + 1;
+  return true;
+}
+}  // end namespace InfraredEdges
+
+// The decoders. The infrared input is default high, active low. Every phase
+// is checked against what the protocol allows as soon as it ends, so each
+// decoder rejects junk, or a frame of another protocol, after the first
+// implausible phase, and waits for the next start.
+//
+// NEC, as the Epson remote speaks it: a leader of 9ms low, 4.5ms high. Then
+// 32 bits, each a 560us low phase followed by a high phase whose duration
+// encodes the bit: ~560us == 0, ~1690us == 1. While a button is held, the
+// remote sends a repeat code every 108ms instead: 9ms low, 2.25ms high and
+// a single 560us low phase.
+//
+// With RC5_SONY:
+// RC5 (Philips): 14 bits of 1.778ms, Manchester coded: a one is high, then
+// low, a zero the other way round. Start bit (always one), field bit
+// (inverted bit 6 of the command), toggle, 5 bits address, 6 bits command.
+// Held buttons repeat the frame every 114ms with the same toggle bit;
+// another press flips it.
+//
+// Sony SIRC: a leader of 2.4ms low, then 12, 15 or 20 bits, LSB first: a
+// 600us high phase, then low 600us == 0, 1200us == 1. 7 bits command, the
+// rest is the address. Frames start every 45ms, at least three per press.
+// Only the pause after it tells how many bits a frame has.
+//
+// Frames of all protocols come as 4 bytes like NEC ones: two bytes address,
+// command, inverted command. RC5 and Sony addresses are tagged in the first
+// byte, so they look like NEC addresses that are unlikely to be in use.
+class InfraredReceiver {
+public:
+  enum Result {
+    IR_NONE,
+    IR_FRAME,   // New 4 byte frame.
+    IR_REPEAT   // Button still held.
+  };
+
+#if RC5_SONY
+  enum {
+    RC5_TAG  = 0x5C,   // First address byte; the second is the address.
+    SONY_TAG = 0xE0,   // First address byte, ORed with address bits 8..12.
+  };
+#endif
+
+  InfraredReceiver()
+    : last_edge_(0), last_result_time_(0), nec_state_(STATE_IDLE),
+#if RC5_SONY
+      rc5_halves_(STATE_IDLE), sony_state_(STATE_IDLE), rc5_toggle_(0),
+#endif
+      repeat_ms_(NEC_REPEAT_MS), timeout_pending_(false), stuck_(false),
+      recent_(false) {
+    for (byte_t i = 0; i < 4; ++i)
+      buffer_[i] = 0;
+  }
+
+  // Nothing left to decode, no transmission in progress, and no repeat
+  // expected: that is timed with the clock, which stops in power-down.
+  bool is_idle() const { return decoders_idle() && !recent_; }
+
+  // There are edges the decoders haven't seen yet.
+  bool has_edges() const { return !InfraredEdges::empty(); }
+
+  // To be called regularly from the main loop. Once the input stays at a
+  // level for longer than any valid phase, this ends the phase for the
+  // decoders: the pause after a Sony frame, or a transmission that stopped
+  // in the middle, or an input stuck low. So that doesn't keep us from
+  // power-down. Returns true for the latter two.
+  // Also ends the time a repeat is accepted in, while the 16 bit stamps
+  // can still tell; later they would wrap around.
+  bool check_timeout() {
+    bool timed_out = false;
+    const byte_t sreg = SREG;
+    cli();
+    const Clock::cycle_t now = Clock::now();
+    if (recent_
+        && (Clock::cycle_t) (now - last_result_time_) >= REPEAT_TIMEOUT)
+      recent_ = false;
+    if (InfraredEdges::empty() && !decoders_idle()
+        && (Clock::cycle_t) (now - InfraredEdges::last_time) > PHASE_TIMEOUT) {
+      timed_out = nec_state_ != STATE_IDLE;
+#if RC5_SONY
+      // The start of an RC5 frame is just one short low phase, which the
+      // end of an NEC frame can look like. Only counts with a few bits.
+      timed_out = timed_out
+        || (rc5_halves_ >= 2 * 3 && rc5_halves_ < 2 * 14)
+        || (sony_state_ != STATE_IDLE && !sony_complete());
+#endif
+      timeout_edge_ = InfraredEdges::head;
+      timeout_pending_ = true;
+      InfraredEdges::push(infrared_in(), now);
+    }
+    SREG = sreg;
+    return timed_out;
+  }
+
+  // Decode the captured edges until something has been received, or there
+  // are no more. If it is a frame, it is copied to the 4 bytes in 'buffer'.
+  Result get_result(byte_t *buffer) {
+    Clock::cycle_t edge;
+    for (;;) {
+      // Not a real edge, but from check_timeout(): the input stays as it is.
+      stuck_ = timeout_pending_ && InfraredEdges::tail == timeout_edge_;
+      if (!InfraredEdges::pop(&edge))
         break;
-      ++buffer;
-      *buffer = 0;
+      if (stuck_)
+        timeout_pending_ = false;
+      const bool high = edge & 1;
+      const Clock::cycle_t duration = (edge & ~1) - last_edge_;
+      last_edge_ = edge & ~1;
+      // All decoders see every phase.
+      Result result = decode_nec(high, duration);
+#if RC5_SONY
+      const bool rc5 = decode_rc5(high, duration);
+      const bool sony = decode_sony(high, duration);
+#endif
+      // Only a repeat if it follows closely the frame it repeats.
+      const bool soon = recent_
+        && (Clock::cycle_t) (last_edge_ - last_result_time_) < REPEAT_TIMEOUT;
+#if RC5_SONY
+      if (rc5 || sony)
+        result = (same_ && soon) ? IR_REPEAT : IR_FRAME;
+      else
+#endif
+      if (result == IR_NONE || (result == IR_REPEAT && !soon))
+        continue;
+      last_result_time_ = last_edge_;
+      recent_ = true;
+#if RC5_SONY
+      if (result == IR_FRAME)
+        repeat_ms_ = rc5 ? RC5_REPEAT_MS
+          : sony ? SONY_REPEAT_MS : NEC_REPEAT_MS;
+#endif
+      if (result == IR_FRAME) {
+        for (byte_t i = 0; i < 4; ++i)
+          buffer[i] = buffer_[i];
+      }
+      return result;
     }
+    return IR_NONE;
   }
-  return read;
+
+  // How often the remote of the last frame repeats while a button is held.
+  byte_t repeat_ms() const { return repeat_ms_; }
+
+private:
+  enum { NEC_REPEAT_MS = 108, RC5_REPEAT_MS = 114, SONY_REPEAT_MS = 45 };
+
+  // Phase durations in clock cycles, with some tolerance for the TSOP.
+  enum {
+    LEADER_LOW_MIN  = Clock::Micros<8000>::cycles,
+    LEADER_LOW_MAX  = Clock::Micros<10000>::cycles,
+    LEADER_HIGH_MIN = Clock::Micros<4000>::cycles,
+    LEADER_HIGH_MAX = Clock::Micros<5000>::cycles,
+    REPEAT_HIGH_MIN = Clock::Micros<1750>::cycles,
+    REPEAT_HIGH_MAX = Clock::Micros<2750>::cycles,
+    BIT_LOW_MIN     = Clock::Micros<250>::cycles,
+    BIT_LOW_MAX     = Clock::Micros<900>::cycles,
+    BIT_ONE_MIN     = Clock::Micros<1250>::cycles,
+    BIT_ONE_MAX     = Clock::Micros<2100>::cycles,
+#if RC5_SONY
+    RC5_HALF_MIN    = Clock::Micros<640>::cycles,
+    RC5_HALF_MAX    = Clock::Micros<1140>::cycles,
+    RC5_FULL_MIN    = Clock::Micros<1400>::cycles,
+    RC5_FULL_MAX    = Clock::Micros<2200>::cycles,
+    SONY_LEADER_MIN = Clock::Micros<2000>::cycles,
+    SONY_LEADER_MAX = Clock::Micros<2800>::cycles,
+    SONY_SHORT_MIN  = Clock::Micros<400>::cycles,
+    SONY_SHORT_MAX  = Clock::Micros<850>::cycles,
+    SONY_LONG_MIN   = Clock::Micros<1000>::cycles,
+    SONY_LONG_MAX   = Clock::Micros<1500>::cycles,
+#endif
+    REPEAT_TIMEOUT  = Clock::Micros<150000>::cycles,
+    PHASE_TIMEOUT   = Clock::Micros<12000>::cycles,  // > longest phase.
+  };
+
+  // Decoder states. Below these, the progress within the frame.
+  enum {
+    STATE_IDLE   = 0xFF,
+    STATE_LEADER = 0xFE,   // Leader started: the input just went low.
+    STATE_NEC_LEADER_HIGH = 0xFD,
+  };
+
+  static inline bool in_range(Clock::cycle_t duration,
+                              Clock::cycle_t min, Clock::cycle_t max) {
+    return duration >= min && duration <= max;
+  }
+
+  // Give up on the current frame, or it is complete. If the phase that
+  // ended was high, the input just went low, which might start the next
+  // frame.
+  byte_t restart(bool high) const {
+    return (high && !stuck_) ? STATE_LEADER : STATE_IDLE;
+  }
+
+  // state: the number of phases of the data bits so far, even ones low.
+  Result decode_nec(bool high, Clock::cycle_t duration) {
+    switch (nec_state_) {
+    case STATE_IDLE:
+      break;
+
+    case STATE_LEADER:
+      if (!high && in_range(duration, LEADER_LOW_MIN, LEADER_LOW_MAX)) {
+        nec_state_ = STATE_NEC_LEADER_HIGH;
+        return IR_NONE;
+      }
+      break;
+
+    case STATE_NEC_LEADER_HIGH:
+      if (!high)
+        break;
+      if (in_range(duration, LEADER_HIGH_MIN, LEADER_HIGH_MAX)) {
+        nec_state_ = 0;   // Data bits start.
+        return IR_NONE;
+      }
+      nec_state_ = restart(high);
+      if (in_range(duration, REPEAT_HIGH_MIN, REPEAT_HIGH_MAX))
+        return IR_REPEAT;
+      return IR_NONE;
+
+    default: {
+      const bool low_phase = (nec_state_ & 1) == 0;
+      if (high == low_phase)
+        break;
+      if (low_phase) {
+        // End of the low phase of a bit. Always of the same length.
+        if (!in_range(duration, BIT_LOW_MIN, BIT_LOW_MAX))
+          break;
+        ++nec_state_;
+        return IR_NONE;
+      }
+      const byte_t bit = nec_state_ >> 1;
+      const byte_t current_bit = 0x80 >> (bit & 0x07);
+      if (current_bit == 0x80)
+        buffer_[bit >> 3] = 0;
+      if (in_range(duration, BIT_ONE_MIN, BIT_ONE_MAX))
+        buffer_[bit >> 3] |= current_bit;
+      else if (!in_range(duration, BIT_LOW_MIN, BIT_LOW_MAX))
+        break;
+      if (++nec_state_ < 2 * 32)
+        return IR_NONE;
+      nec_state_ = restart(high);
+      return IR_FRAME;
+    }
+    }
+    nec_state_ = restart(high);
+    return IR_NONE;
+  }
+
+#if RC5_SONY
+  // state: the number of half bits so far. The first half of the start
+  // bit is high, like the input before, so it starts with the edge in the
+  // middle of it.
+  bool decode_rc5(bool high, Clock::cycle_t duration) {
+    if (rc5_halves_ == STATE_LEADER && !high) {
+      rc5_halves_ = 1;
+      rc5_bits_ = 1;
+    }
+    byte_t halves = 0;
+    if (rc5_halves_ < 2 * 14) {
+      if (in_range(duration, RC5_HALF_MIN, RC5_HALF_MAX))
+        halves = 1;
+      else if (in_range(duration, RC5_FULL_MIN, RC5_FULL_MAX))
+        halves = 2;
+    }
+    if (halves == 0 || rc5_halves_ + halves > 2 * 14) {
+      rc5_halves_ = restart(high);
+      return false;
+    }
+    for (; halves; --halves) {
+      if ((rc5_halves_ & 1) == 0) {
+        rc5_bits_ = (rc5_bits_ << 1) | high;   // First half: the bit.
+      } else if ((rc5_bits_ & 1) == high) {
+        rc5_halves_ = restart(high);   // No level change in the middle.
+        return false;
+      }
+      ++rc5_halves_;
+    }
+    // If the last bit is a zero, it ends high: no edge after it.
+    if (rc5_halves_ < 2 * 14 && (high || rc5_halves_ < 2 * 14 - 1))
+      return false;
+    rc5_halves_ = restart(high);
+    const byte_t command = (rc5_bits_ & 0x3F) | (~rc5_bits_ >> 6 & 0x40);
+    const byte_t toggle = (rc5_bits_ >> 11) & 1;
+    set_frame(RC5_TAG, (rc5_bits_ >> 6) & 0x1F, command);
+    same_ &= toggle == rc5_toggle_;   // Flips with each new press.
+    rc5_toggle_ = toggle;
+    return true;
+  }
+
+  // A Sony frame ends with a low phase; it's complete if the number of
+  // bits is valid.
+  bool sony_complete() const {
+    return (sony_state_ & 1) == 0 && (sony_state_ == 2 * 12
+                                      || sony_state_ == 2 * 15
+                                      || sony_state_ == 2 * 20);
+  }
+
+  // state: the number of phases of the data bits so far, even ones high.
+  bool decode_sony(bool high, Clock::cycle_t duration) {
+    switch (sony_state_) {
+    case STATE_IDLE:
+      break;
+
+    case STATE_LEADER:
+      if (!high && in_range(duration, SONY_LEADER_MIN, SONY_LEADER_MAX)) {
+        sony_state_ = 0;
+        sony_bits_ = 0;
+        return false;
+      }
+      break;
+
+    default:
+      if ((sony_state_ & 1) == 0) {
+        if (!high)
+          break;
+        if (in_range(duration, SONY_SHORT_MIN, SONY_SHORT_MAX)
+            && sony_state_ < 2 * 20) {
+          ++sony_state_;
+          return false;
+        }
+        // The pause after the frame.
+        if (!sony_complete())
+          break;
+        const byte_t command = sony_bits_ & 0x7F;
+        const unsigned short address = sony_bits_ >> 7;
+        set_frame(SONY_TAG | (address >> 8), address, command);
+        sony_state_ = restart(high);
+        return true;
+      }
+      if (high)
+        break;
+      if (in_range(duration, SONY_LONG_MIN, SONY_LONG_MAX))
+        sony_bits_ |= 1UL << (sony_state_ >> 1);
+      else if (!in_range(duration, SONY_SHORT_MIN, SONY_SHORT_MAX))
+        break;
+      ++sony_state_;
+      return false;
+    }
+    sony_state_ = restart(high);
+    return false;
+  }
+#endif
+
+  bool decoders_idle() const {
+#if RC5_SONY
+    if (rc5_halves_ != STATE_IDLE || sony_state_ != STATE_IDLE)
+      return false;
+#endif
+    return InfraredEdges::empty() && nec_state_ == STATE_IDLE;
+  }
+
+#if RC5_SONY
+  // Frame from RC5 or Sony. These send the frame again while a button is
+  // held, so tell if it is the same as the last one.
+  void set_frame(byte_t address0, byte_t address1, byte_t command) {
+    same_ = buffer_[0] == address0 && buffer_[1] == address1
+      && buffer_[2] == command;
+    buffer_[0] = address0;
+    buffer_[1] = address1;
+    buffer_[2] = command;
+    buffer_[3] = ~command;
+  }
+#endif
+
+  Clock::cycle_t last_edge_;
+  Clock::cycle_t last_result_time_;
+  byte_t nec_state_;
+#if RC5_SONY
+  byte_t rc5_halves_;
+  byte_t sony_state_;
+  byte_t rc5_toggle_;
+#endif
+  byte_t repeat_ms_;
+  byte_t timeout_edge_;      // Index of the edge from check_timeout().
+  bool timeout_pending_;
+  bool stuck_;               // Decoding that edge.
+  bool recent_;              // last_result_time_ within REPEAT_TIMEOUT.
+#if RC5_SONY
+  bool same_;                // RC5 or Sony frame the same as the last.
+  unsigned short rc5_bits_;
+  unsigned long sony_bits_;
+#endif
+  byte_t buffer_[4];         // Being received, or the last one.
+};
+
+// Capture the edge leaving the current level of the IR input next.
+// Usually the opposite of what we just got, but if we missed an edge in a
+// glitch, this re-synchronizes; the decoders then reject the odd timing.
+static inline void infrared_capture_next_edge() {
+  if (infrared_in())
+    TCCR1B &= ~(1<<ICES1);
+  else
+    TCCR1B |= (1<<ICES1);
+  TIFR1 = (1<<ICF1);      // Changing edge might trigger capture: clear.
+}
+
+ISR(TIM1_CAPT_vect) {
+  const Clock::cycle_t time = ICR1;
+  const bool got_rising_edge = (TCCR1B & (1<<ICES1)) != 0;
+  infrared_capture_next_edge();
+  InfraredEdges::push(!got_rising_edge, time);
+}
+
+#if SYNC_BUS
+// Sync bus between screens on A3. Open drain: idle high, pulled up by each
+// unit, only the master pulls it low. A frame: a leader of 2ms low, 500us
+// high, then 40 bits, LSB first, each a low phase of 250us (0) or 750us (1)
+// and 250us high. The bytes: target (short), tick period of the master
+// (0: motor off), then their sum plus one. The master sends whenever where
+// it is going changes, and while running, every 250ms for the speed. All
+// units need the same clock options: the tick period is in clock cycles.
+namespace SyncBus {
+static const byte_t SIZE = 5;
+static const byte_t BITS = 8 * SIZE;
+
+enum {
+  LEADER_LOW  = Clock::Micros<2000>::cycles,
+  LEADER_HIGH = Clock::Micros<500>::cycles,
+  ZERO_LOW    = Clock::Micros<250>::cycles,
+  ONE_LOW     = Clock::Micros<750>::cycles,
+  BIT_HIGH    = Clock::Micros<250>::cycles,
+  // Receiving; with some tolerance for the interrupt latency.
+  ONE_MIN     = Clock::Micros<500>::cycles,
+  ONE_MAX     = Clock::Micros<1200>::cycles,
+  LEADER_MIN  = Clock::Micros<1500>::cycles,
+  LEADER_MAX  = Clock::Micros<3000>::cycles,
+  FRAME_TIMEOUT = Clock::Micros<10000>::cycles,   // No edge in a frame.
+};
+
+static byte_t checksum(const byte_t *frame) {
+  byte_t sum = 1;   // A bus stuck low doesn't give a valid frame.
+  for (byte_t i = 0; i < SIZE - 1; ++i)
+    sum += frame[i];
+  return sum;
+}
+
+#if SYNC_BUS == SYNC_MASTER
+static const Clock::cycle32_t RESEND = Clock::Cycles<250>::value;
+
+static byte_t frame[SIZE];
+static volatile byte_t phase;   // Of the frame being sent; 0: idle.
+static short sent_target = 0x7FFF;   // Nothing sent yet.
+static Clock::cycle_t sent_period;
+static Clock::cycle32_t sent_time;
+
+static inline bool is_idle() { return phase == 0; }
+
+static inline void pull_low(bool low) {
+  if (low) {
+    PORTA &= ~IO_SYNC_A;
+    DDRA |= IO_SYNC_A;
+  } else {
+    DDRA &= ~IO_SYNC_A;
+    PORTA |= IO_SYNC_A;    // Pullup.
+  }
+}
+
+// From the compare interrupt: the next phase of the frame, 1 is the low of
+// the leader.
+static void step() {
+  const byte_t p = phase;
+  Clock::cycle_t duration;
+  if (p == 1) {
+    pull_low(true);
+    duration = LEADER_LOW;
+  } else if (p == 2) {
+    pull_low(false);
+    duration = LEADER_HIGH;
+  } else if (p < 3 + 2 * BITS) {
+    const byte_t bit = (p - 3) >> 1;
+    pull_low(p & 1);
+    if (p & 1)
+      duration = ((frame[bit >> 3] >> (bit & 0x07)) & 1) ? ONE_LOW : ZERO_LOW;
+    else
+      duration = BIT_HIGH;
+  } else {
+    TIMSK1 &= ~(1<<OCIE1B);
+    phase = 0;
+    return;
+  }
+  OCR1B += duration;
+  phase = p + 1;
+}
+
+static void send(short target, Clock::cycle_t period) {
+  frame[0] = target;
+  frame[1] = target >> 8;
+  frame[2] = period;
+  frame[3] = period >> 8;
+  frame[4] = checksum(frame);
+  sent_target = target;
+  sent_period = period;
+  sent_time = Clock::now32();
+  const byte_t sreg = SREG;
+  cli();
+  phase = 1;
+  OCR1B = Clock::now() + 2;
+  TIFR1 = (1<<OCF1B);
+  TIMSK1 |= (1<<OCIE1B);
+  SREG = sreg;
+}
+
+// Called from the main loop with where the screen is going and its tick
+// period; sends what changed.
+static void update(short target, Clock::cycle_t period) {
+  if (!is_idle())
+    return;
+  if (target == sent_target && (period == 0) == (sent_period == 0)
+      && (period == 0 || Clock::now32() - sent_time < RESEND))
+    return;
+  send(target, period);
+}
+#else
+static byte_t frame[SIZE];
+static byte_t bit = BITS;          // Next to receive; BITS: not in a frame.
+static bool low;                   // Level of the bus.
+static volatile Clock::cycle_t edge_time;
+static short target;               // Of the last complete frame.
+static Clock::cycle_t period;
+
+// Not while the bus is low either: that may be a leader, which needs the
+// timer running.
+static inline bool is_idle() { return bit == BITS && !low; }
+
+// From the pin change interrupt, which is shared with other pins. The low
+// phases carry the bits; tells the main loop once a frame is complete.
+static void edge() {
+  const bool now_low = (PINA & IO_SYNC_A) == 0;
+  if (now_low == low)
+    return;
+  low = now_low;
+  const Clock::cycle_t now = Clock::now();
+  const Clock::cycle_t duration = now - edge_time;
+  edge_time = now;
+  if (low)
+    return;
+  if (duration >= LEADER_MIN && duration <= LEADER_MAX) {
+    bit = 0;
+    return;
+  }
+  if (bit == BITS)
+    return;
+  if (duration > ONE_MAX) {
+    bit = BITS;
+    return;
+  }
+  const byte_t mask = 1 << (bit & 0x07);
+  if (duration >= ONE_MIN)
+    frame[bit >> 3] |= mask;
+  else
+    frame[bit >> 3] &= ~mask;
+  if (++bit < BITS || frame[4] != checksum(frame))
+    return;
+  target = frame[0] | (frame[1] << 8);
+  period = frame[2] | (frame[3] << 8);
+  EventQueue::push(EventQueue::SYNC_RECEIVED, now);
+}
+
+// The last frame, for the main loop.
+static void take(short *t, Clock::cycle_t *p) {
+  const byte_t sreg = SREG;
+  cli();
+  *t = target;
+  *p = period;
+  SREG = sreg;
+}
+
+// A frame that stopped midway doesn't keep us from power-down.
+static void check_timeout() {
+  const byte_t sreg = SREG;
+  cli();
+  if (bit != BITS && (Clock::cycle_t) (Clock::now() - edge_time)
+      > FRAME_TIMEOUT)
+    bit = BITS;
+  SREG = sreg;
+}
+#endif
+}  // end namespace SyncBus
+
+#if SYNC_BUS == SYNC_MASTER
+ISR(TIM1_COMPB_vect) {
+  SyncBus::step();
+}
+#endif
+#endif
+
+#if WIRED_TRIGGER
+// The trigger shares the pin change interrupt of port A. Only tells the
+// main loop if its level changed; it's not the only pin.
+static volatile bool trigger_level;
+static inline void trigger_changed() {
+  if (trigger_in() == trigger_level)
+    return;
+  trigger_level = !trigger_level;
+  EventQueue::push(EventQueue::TRIGGER_CHANGE, Clock::now());
+}
+#endif
+
+#if QUADRATURE_ENCODER
+// Second encoder channel changed. We never use power-down with the
+// quadrature encoder, so this is never the IR wakeup.
+ISR(PCINT0_vect) {
+#if WIRED_TRIGGER
+  trigger_changed();
+#endif
+#if SYNC_BUS == SYNC_FOLLOWER
+  SyncBus::edge();
+#endif
+  quadrature_update(encoder_a);
+}
+#else
+// Pin change on the IR input. Only armed while in power-down: the timer is
+// stopped there, so the input capture would miss the first edge of a
+// transmission. Hand it to the decoders ourselves.
+// With a crystal, the endswitch is on this port as well. Which pin changed
+// isn't known, but the main loop looks at the endswitch level anyway.
+ISR(PCINT0_vect) {
+#if CRYSTAL
+  EventQueue::push(EventQueue::ENDSWITCH_CHANGE, Clock::now());
+#endif
+#if WIRED_TRIGGER
+  trigger_changed();
+#endif
+#if SYNC_BUS == SYNC_FOLLOWER
+  SyncBus::edge();
+#endif
+#if CRYSTAL || WIRED_TRIGGER || SYNC_BUS == SYNC_FOLLOWER
+  if (!(PCMSK0 & (1<<PCINT7)))
+    return;
+#endif
+  PCMSK0 &= ~(1<<PCINT7);
+  if (!infrared_in()) {
+    infrared_capture_next_edge();
+    InfraredEdges::push(true, Clock::now());
+  }
+}
+#endif
+
+#if !CRYSTAL
+// Endswitch changed.
+ISR(PCINT1_vect) {
+  EventQueue::push(EventQueue::ENDSWITCH_CHANGE, Clock::now());
+}
+#endif
+
+// Periodic wakeup while sleeping in idle mode, so that timeouts are checked
+// and the LED blinks.
+static const Clock::cycle_t WAKEUP_INTERVAL = Clock::Micros<32000>::cycles;
+
+ISR(TIM1_COMPA_vect) {
+  OCR1A += WAKEUP_INTERVAL;
+  StatusLed::step();
+}
+
+// The main loop hangs. Stop the motor here, it might never get to it.
+ISR(WDT_vect) {
+  MotorPwm::off();
+  PORTA &= ~OUT_MOT_DN_A;
+  MOT_UP_PORT &= ~OUT_MOT_UP;
 }
 
 enum Button {     // Infrared signal:
-  BUTTON_ON,    //  E0 D5 04 FB
-  BUTTON_OFF,   //  E0 D5 44 BB
-  BUTTON_UP,    //  E0 D5 06 F9
-  BUTTON_DOWN,  //  E0 D5 26 D9
-  BUTTON_SET,   //  E0 D5 50 AF
-  BUTTON_UNKNOWN
+  BUTTON_ON,    //  C1 AA 09 F6
+  BUTTON_OFF,   //  C1 AA 89 76
+  BUTTON_UP,    //  C1 AA 0D F2
+  BUTTON_DOWN,  //  C1 AA 4D B2
+  BUTTON_SET,   //  C1 AA A1 5E
+  BUTTON_UNKNOWN  // Also the number of buttons.
 };
 
+// Address of the Epson remote: first two bytes of each frame.
+enum {
+  IR_ADDRESS_0 = 0xC1,
+  IR_ADDRESS_1 = 0xAA
+};
+
+// Command byte (third byte of the frame) to button mapping.
+struct ButtonCode {
+  byte_t command;
+  byte_t button;
+};
+static const ButtonCode button_codes[] PROGMEM = {
+  { 0x09, BUTTON_ON },
+  { 0x89, BUTTON_OFF },
+  { 0x0D, BUTTON_UP },
+  { 0x4D, BUTTON_DOWN },
+  { 0xA1, BUTTON_SET },
+};
+
+// Remotes learned in addition to the Epson one, in EEPROM: per remote the
+// address, i.e. the first two bytes of its frames, and the command byte of
+// each button. The last byte of a frame is the inverse of the command, so
+// that is the whole frame. A remote is in the slot its address hashes to,
+// or in the next free one after that. Looking up a frame is one address
+// compare in the common case, however many remotes and buttons there are.
+//
+// Learning: the buttons are pressed in the order of enum Button, all on
+// the same remote. A button that is taken already is skipped. Only the
+// complete remote is written; nothing if it takes too long.
+#if LEARN_REMOTES
+namespace RemoteTable {
+enum { REMOTE_COUNT = 4 };   // Power of two.
+static const Clock::cycle32_t LEARN_TIMEOUT = Clock::Cycles<10000>::value;
+// In the first minute after power-up, holding any button starts learning,
+// also one of a remote we don't know yet. That is timed with the clock, so
+// no power-down until then.
+static const Clock::cycle32_t ANY_BUTTON_TIME =
+  2 * Clock::Cycles<30000>::value;
+
+struct Remote {
+  byte_t command[BUTTON_UNKNOWN];
+  byte_t address[2];   // Written last. Erased: 0xFF 0xFF, a free slot.
+};
+static Remote eeprom_remotes[REMOTE_COUNT] EEMEM;
+
+static byte_t learning;   // 0: not learning, else 1 + the next button.
+static Clock::cycle32_t learn_time;   // Of the last button learned.
+static Remote learned;
+static bool any_button_over;
+
+// Plain NEC remotes send the address and its inverse, so both bytes need
+// to go into the hash differently.
+static byte_t hash(const byte_t *address) {
+  return (address[0] ^ (address[1] << 1)) & (REMOTE_COUNT - 1);
+}
+
+// Slot of the remote with the given address. If there is none, 'known' is
+// false and it is where to learn it: the first free slot, or if there is
+// no free one, the one it hashes to.
+static byte_t find(const byte_t *address, bool *known) {
+  const byte_t first = hash(address);
+  byte_t slot = first;
+  *known = false;
+  do {
+    const byte_t a0 = eeprom_read_byte(&eeprom_remotes[slot].address[0]);
+    const byte_t a1 = eeprom_read_byte(&eeprom_remotes[slot].address[1]);
+    if (a0 == 0xFF && a1 == 0xFF)
+      return slot;   // Not further along.
+    if (a0 == address[0] && a1 == address[1]) {
+      *known = true;
+      return slot;
+    }
+    slot = (slot + 1) & (REMOTE_COUNT - 1);
+  } while (slot != first);
+  return first;
+}
+
+// Button of a frame with a valid checksum.
+static Button lookup(const byte_t *frame) {
+  bool known;
+  const Remote *const remote = &eeprom_remotes[find(frame, &known)];
+  if (known) {
+    for (byte_t b = 0; b < BUTTON_UNKNOWN; ++b) {
+      if (eeprom_read_byte(&remote->command[b]) == frame[2])
+        return (Button) b;
+    }
+  }
+  return BUTTON_UNKNOWN;
+}
+
+static void start_learning() {
+  learning = 1;
+  learn_time = Clock::now32();
+}
+
+// Frame with a valid checksum while learning.
+static void learn(const byte_t *frame) {
+  const byte_t button = learning - 1;
+  if (button == 0) {
+    learned.address[0] = frame[0];
+    learned.address[1] = frame[1];
+  } else if (frame[0] != learned.address[0]
+             || frame[1] != learned.address[1]) {
+    return;   // Another remote.
+  }
+  for (byte_t b = 0; b < button; ++b) {
+    if (learned.command[b] == frame[2])
+      return;
+  }
+  learned.command[button] = frame[2];
+  learn_time = Clock::now32();
+  if (++learning <= BUTTON_UNKNOWN)
+    return;
+  learning = 0;
+  bool known;
+  Remote *const remote = &eeprom_remotes[find(learned.address, &known)];
+  eeprom_update_block(learned.command, remote->command,
+                      sizeof(remote->command));
+  eeprom_update_block(learned.address, remote->address,
+                      sizeof(remote->address));
+}
+
+// To be called regularly from the main loop.
+static void check_timeout() {
+  if (learning && Clock::now32() - learn_time >= LEARN_TIMEOUT)
+    learning = 0;
+  if (!any_button_over && Clock::now32() >= ANY_BUTTON_TIME)
+    any_button_over = true;
+}
+}  // end namespace RemoteTable
+#endif
+
+// The last byte is the inverse of the command. Cheapest way to reject
+// broken frames, so check that first.
+static bool frame_ok(const byte_t *buffer) {
+  return buffer[2] == (byte_t)~buffer[3];
+}
+
 // Decode infrared signal and return matching Screen direction commands.
 static Button DecodeInfrared(byte_t *buffer) {
-  if (buffer[0] != 0xE0 && buffer[1] != 0xD5)
+  if (!frame_ok(buffer))
+    return BUTTON_UNKNOWN;
+#if LEARN_REMOTES
+  const Button learned = RemoteTable::lookup(buffer);
+  if (learned != BUTTON_UNKNOWN)
+    return learned;
+#endif
+  if (buffer[0] != IR_ADDRESS_0 || buffer[1] != IR_ADDRESS_1)
     return BUTTON_UNKNOWN;
   const byte_t u = buffer[2];
-  const byte_t l = buffer[3];
-  if (u == 0x04 && l == 0xFB) return BUTTON_ON;
-  if (u == 0x44 && l == 0xBB) return BUTTON_OFF;
-  if (u == 0x06 && l == 0xF9) return BUTTON_UP;
-  if (u == 0x26 && l == 0xD9) return BUTTON_DOWN;
-  if (u == 0x50 && l == 0xAF) return BUTTON_SET;
+  for (byte_t i = 0; i < sizeof(button_codes) / sizeof(button_codes[0]); ++i) {
+    if (pgm_read_byte(&button_codes[i].command) == u)
+      return (Button) pgm_read_byte(&button_codes[i].button);
+  }
   return BUTTON_UNKNOWN;
 }
 
 class Monoflop {
 public:
-  Monoflop(Clock::cycle_t cycles)
+  Monoflop(Clock::cycle32_t cycles)
     : duration_(cycles), trigger_time_(0), active_(false) {
   }
 
   void trigger() {
-    trigger_time_ = Clock::now();
+    trigger_time_ = Clock::now32();
     active_ = true;
   }
 
   bool is_active() { return active_; }
+  void reset() { active_ = false; }
 
   // This check has to be called regularly somewhere in the main-loop.
   void regular_check() {
-    if (active_ && Clock::now() - trigger_time_ >= duration_) {
+    if (active_ && Clock::now32() - trigger_time_ >= duration_) {
       active_ = false;
     }
   }
 
 private:
-  const Clock::cycle_t duration_;
-  Clock::cycle_t trigger_time_;
+  const Clock::cycle32_t duration_;
+  Clock::cycle32_t trigger_time_;
   bool active_;
 };
 
+// Long enough holding a button to mean something else: two seconds. Added
+// up from the repeats.
+static const unsigned short HOLD_MS = 2000;
+
 // We react on the on/off buttons to move the screen. The 'on' button allows
 // to toggle the screen up/down (e.g. for a break while movie).
-static void handle_infrared(Screen *screen, Monoflop *special_keys_active) {
-  byte_t infrared_bytes[4] = {0, 0, 0, 0};
-  if (read_infrared(infrared_bytes) != 4)
-    return;
-  switch (DecodeInfrared(infrared_bytes)) {
+// Returns true if a button of the remote was recognized.
+static bool handle_infrared(InfraredReceiver *infrared, Screen *screen,
+                            Monoflop *special_keys_active) {
+  static Button last_button = BUTTON_UNKNOWN;
+  static unsigned short held_ms;
+  byte_t infrared_bytes[4];
+  Button button;
+  bool long_hold = false;   // Held for HOLD_MS just now.
+  switch (infrared->get_result(infrared_bytes)) {
+  case InfraredReceiver::IR_FRAME:
+#if LEARN_REMOTES
+    if (RemoteTable::learning) {
+      if (frame_ok(infrared_bytes))
+        RemoteTable::learn(infrared_bytes);
+      return true;
+    }
+#endif
+    button = last_button = DecodeInfrared(infrared_bytes);
+    held_ms = 0;
+    if (button == BUTTON_UNKNOWN)
+      Diagnostics::ir_rejected();
+    break;
+  case InfraredReceiver::IR_REPEAT:
+    if (held_ms < HOLD_MS) {
+      held_ms += infrared->repeat_ms();
+      long_hold = held_ms >= HOLD_MS;
+    }
+#if LEARN_REMOTES
+    // Holding SET for two seconds without OFF before: learn a remote. In
+    // the first minute, any button.
+    if (long_hold && !special_keys_active->is_active()
+        && !screen->is_moving() && !RemoteTable::learning
+        && (last_button == BUTTON_SET
+            || !RemoteTable::any_button_over)) {
+      RemoteTable::start_learning();
+      last_button = BUTTON_UNKNOWN;   // Not a button anymore.
+      return true;
+    }
+#endif
+    // Holding SET for two seconds after OFF, at home: send the diagnostics.
+    if (last_button == BUTTON_SET) {
+      if (long_hold && special_keys_active->is_active()
+          && !screen->is_moving())
+        Diagnostics::dump();
+      return true;
+    }
+    // Button is held. Only continue up/down; repeating a toggle would make
+    // the screen change its mind all the time.
+    if (last_button != BUTTON_UP && last_button != BUTTON_DOWN)
+      return false;
+    button = last_button;
+    break;
+  default:
+    return false;
+  }
+  switch (button) {
   case BUTTON_ON:
     screen->toggle_screen_pos();
     break;
@@ -344,67 +2412,310 @@ static void handle_infrared(Screen *screen, Monoflop *special_keys_active) {
     break;
   case BUTTON_UP:
     if (special_keys_active->is_active())
-      screen->set_dir(Screen::DIR_UP);
+      screen->set_dir_manual(Screen::DIR_UP);
     break;
   case BUTTON_DOWN:
     if (special_keys_active->is_active())
-      screen->set_dir(Screen::DIR_DOWN);
+      screen->set_dir_manual(Screen::DIR_DOWN);
+    break;
+  case BUTTON_SET:
+    // Programming a preset: first 'set' stops the screen where it is, the
+    // second stores that position for the last selected preset. The special
+    // keys go inactive as acknowledgement.
+    if (!special_keys_active->is_active())
+      break;
+    if (screen->is_moving()) {
+      screen->set_dir(Screen::DIR_NEUTRAL);
+      special_keys_active->trigger();   // Give time to press 'set' again.
+    } else if (screen->program_preset()) {
+      special_keys_active->reset();
+    }
     break;
   default:
     // ignored.
-    break;
+    return false;
   }
+  return true;
+}
+
+// Sleep until the next interrupt. In idle mode, all interrupts can wake us,
+// timer included. In power-down, only the pin change interrupts of the IR
+// input and the endswitch do. Events are checked with interrupts disabled,
+// so that we never sleep on an unprocessed event.
+static void sleep_until_event(bool power_down) {
+  cli();
+  if (EventQueue::empty()) {
+    if (power_down) {
+#if CRYSTAL
+      // Same, but the crystal keeps running: starting it up again takes
+      // 16k cycles, 1ms, which the leader of an infrared frame can't spare.
+      set_sleep_mode(SLEEP_MODE_STANDBY);
+#else
+      set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+#endif
+      PCMSK0 |= (1<<PCINT7);
+      // Comparator is not needed while the motor is off. The interrupt
+      // needs to be off while switching, otherwise it might trigger.
+      ACSR &= ~(1<<ACIE);
+      ACSR |= (1<<ACD);
+    } else {
+      set_sleep_mode(SLEEP_MODE_IDLE);
+    }
+    if (power_down)
+      Watchdog::stop();
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    if (power_down) {
+      cli();
+      Watchdog::start();
+      PCMSK0 &= ~(1<<PCINT7);
+      ACSR &= ~(1<<ACD);
+      if (!WheelSensor::calibrated)
+        WheelSensor::use_comparator();
+    }
+  }
+  sei();
 }
 
 int main(void) {
-  // Outputs.
-  DDRA = OUT_STATUSLED_A | OUT_MOT_DN_A | OUT_STBIAS_A;
-  DDRB = OUT_MOT_UP_B;
+  Watchdog::init();
 
-  // Switch on pullups.
-  PORTB = IN_RESET_B | IN_ENDSWITCH_B;
+  // Outputs, and pullups on.
+#if CRYSTAL
+  DDRA = OUT_STATUSLED_A | OUT_MOT_DN_A | OUT_STBIAS_A | OUT_MOT_UP;
+  DDRB = OUT_MOT_EN_B;
+  PORTA = IN_ENDSWITCH;
+  PORTB = IN_RESET_B;
+#else
+  DDRA = OUT_STATUSLED_A | OUT_MOT_DN_A | OUT_STBIAS_A;
+  DDRB = OUT_MOT_UP | OUT_MOT_EN_B;
+  PORTB = IN_RESET_B | IN_ENDSWITCH;
+#if WIRED_TRIGGER
+  PORTA = IN_TRIGGER_A;
+#elif SYNC_BUS == SYNC_FOLLOWER
+  // Followers don't need an infrared receiver.
+  PORTA = IO_SYNC_A | IN_IR_A;
+#elif SYNC_BUS
+  PORTA = IO_SYNC_A;
+#endif
+#endif
 
   // Don't need digital input buffer.
   DIDR0 = (1<<ADC2D) | (1<<ADC1D);
 
   Clock::init();
+  Diagnostics::init();
 
-  // Init screen. Need to assign to global_screen before interrupt enable.
   Screen screen;
-  global_screen = &screen;  // referenced in interrupt handler.
+  InfraredReceiver infrared;
+
+  // Not using USI, and ADC only while moving.
+  PRR = (1<<PRUSI) | (1<<PRADC);
 
-  // Enable comparator interrupt. It will give us the rotation tick events.
+  // Enable comparator interrupt. It will give us the rotation tick events,
+  // unless we're calibrated to use the ADC.
   ACSR |= (1<<ACIE);
+  WheelSensor::init();
+
+  // Input capture on ICP, starting with the falling edge of a transmission.
+  // With noise canceler, as the TSOP output has some glitches.
+  TCCR1B |= (1<<ICNC1);
+  OCR1A = Clock::now() + WAKEUP_INTERVAL;  // Not only after the first wrap.
+  TIMSK1 |= (1<<ICIE1) | (1<<OCIE1A);
+
+  // Pin change interrupt on the endswitch and the trigger to wake us up.
+  // The one for the IR input is only armed when going to power-down.
+#if CRYSTAL
+  PCMSK0 = (1<<PCINT5);
+  GIMSK = (1<<PCIE0);
+#else
+  PCMSK1 = (1<<PCINT9);
+#if QUADRATURE_ENCODER
+  quadrature_state = (((ACSR & (1<<ACO)) != 0) << 1)
+    | ((PINA & IN_ENCODER2_A) != 0);
+  PCMSK0 = (1<<PCINT5);
+#endif
+#if WIRED_TRIGGER
+  trigger_level = trigger_in();   // Only changes move the screen.
+  PCMSK0 |= (1<<PCINT3);
+#endif
+#if SYNC_BUS == SYNC_FOLLOWER
+  PCMSK0 |= (1<<PCINT3);
+#endif
+  GIMSK = (1<<PCIE1) | (1<<PCIE0);
+#endif
+
   sei();
 
-  Monoflop special_keys_active(Clock::ms_to_cycles(4000));
+  Monoflop special_keys_active(Clock::Cycles<4000>::value);
+  // After the trigger changed, its level is only looked at again once the
+  // contacts stopped bouncing.
+  Monoflop trigger_settling(Clock::Cycles<50>::value);
+#if WIRED_TRIGGER
+  bool trigger_active = trigger_level;
+#endif
 
-  // until we know that the endswitch is working we keep this switched off.
-  // We assume home position
-  screen.go_home();
+  // After a watchdog reset, we carry on. If we know from last time where we
+  // are, that's it. Otherwise we need to find the home position.
+  short stored_pos;
+  const Watchdog::ResumeState *resume = Watchdog::take();
+  const bool stored = PositionStore::restore(&stored_pos);
+  const bool restored = (resume && screen.resume(*resume))
+    || (stored && screen.restore_position(stored_pos));
+  if (!restored) {
+    screen.go_home();
+  }
+  // A position from a clean stop that isn't plausible: the EEPROM doesn't
+  // keep what we wrote. Shown until the next button.
+  bool eeprom_corrupt = stored && !restored;
+  if (endswitch_in()) {
+    screen.event_endswitch_triggered();
+  }
+  // Homing or resuming is a move as well: starts the wheel sensor.
+  bool was_moving = false;
+  short move_start = screen.position();
 
   for (;;) {
+    Clock::cycle_t loop_start = Clock::now();
+    Watchdog::kick();
+    EventQueue::Event event;
+    while (EventQueue::pop(&event)) {
+      switch (event.type) {
+      case EventQueue::ROTATION_TICK:
+        screen.event_rotation_tick(event.time, Screen::DIR_NEUTRAL);
+        break;
+      case EventQueue::ROTATION_TICK_UP:
+        screen.event_rotation_tick(event.time, Screen::DIR_UP);
+        break;
+      case EventQueue::ROTATION_TICK_DOWN:
+        screen.event_rotation_tick(event.time, Screen::DIR_DOWN);
+        break;
+      case EventQueue::ENDSWITCH_CHANGE:
+        if (endswitch_in()) {
+          screen.event_endswitch_triggered();
+        }
+        break;
+      case EventQueue::INFRARED_RECEIVED:
+        break;   // The edges are decoded below.
+      case EventQueue::TRIGGER_CHANGE:
+        break;   // Looked at below.
+      case EventQueue::SYNC_RECEIVED:
+#if SYNC_BUS == SYNC_FOLLOWER
+        {
+          short target;
+          Clock::cycle_t period;
+          SyncBus::take(&target, &period);
+          screen.follow(target, period);
+        }
+#endif
+        break;
+      }
+    }
     screen.check_stop_conditions();
     special_keys_active.regular_check();
-
-    if (!infrared_in()) {  // an IR transmission starts with low.
-      handle_infrared(&screen, &special_keys_active);
+#if LEARN_REMOTES
+    RemoteTable::check_timeout();
+#endif
+    if (infrared.check_timeout())
+      Diagnostics::ir_timeout();
+    while (infrared.has_edges()) {
+      if (handle_infrared(&infrared, &screen, &special_keys_active))
+        eeprom_corrupt = false;
     }
-    if (endswitch_in()) {
-      screen.event_endswitch_triggered();
+#if SYNC_BUS == SYNC_MASTER
+    SyncBus::update(screen.destination(), screen.running_period());
+#elif SYNC_BUS == SYNC_FOLLOWER
+    SyncBus::check_timeout();
+#endif
+#if WIRED_TRIGGER
+    // The first edge moves the screen right away; what the level is after
+    // the bouncing, counts.
+    trigger_settling.regular_check();
+    if (!trigger_settling.is_active() && trigger_level != trigger_active) {
+      trigger_active = trigger_level;
+      trigger_settling.trigger();
+      if (trigger_active)
+        screen.go_to_preset(0);   // Like ON when up.
+      else
+        screen.set_dir(Screen::DIR_UP);
     }
+#endif
+
+    // Keep the stored position in sync. After an error, we don't trust the
+    // position, so it stays invalid until the next clean stop.
+    if (screen.is_moving() != was_moving) {
+      was_moving = screen.is_moving();
+      if (was_moving) {
+        move_start = screen.position();
+        WheelSensor::start();
+        PositionStore::invalidate();
+      } else {
+        WheelSensor::stop(screen.error() == Screen::ERR_ROTATION
+                          || screen.error() == Screen::ERR_STALL);
+        if (screen.error() == Screen::ERR_NONE) {
+          PositionStore::store(screen.position());
+          Watchdog::clean_stop();
+        }
+        const short ticks = screen.position() - move_start;
+        Diagnostics::move_done(ticks < 0 ? -ticks : ticks,
+                               encoder_move_glitches);
+        Diagnostics::save();
+      }
+    }
+    // Checked after WheelSensor::start() reset the count for a new move.
+    if (encoder_move_glitches >= ENCODER_GLITCH_STORM)
+      screen.event_glitch_storm();
+    screen.save_state();
+
     // LED output depends on the state of the screen
     switch (screen.error()) {
     case Screen::ERR_NONE:
-      status_led(special_keys_active.is_active());
+#if LEARN_REMOTES
+      if (RemoteTable::learning)
+        StatusLed::show(StatusLed::blinks(RemoteTable::learning));
+      else
+#endif
+      if (eeprom_corrupt)
+        StatusLed::show(StatusLed::BLINK_4);
+      else
+        StatusLed::show(special_keys_active.is_active()
+                        ? StatusLed::ON : StatusLed::OFF);
       break;
     case Screen::ERR_SWITCH:
-      status_led(Clock::now() & 1024);  // fast blink.
+      StatusLed::show(StatusLed::FAST);
       break;
     case Screen::ERR_ROTATION:
-      status_led(Clock::now() & 8192);  // slow blink.
+      StatusLed::show(StatusLed::SLOW);
+      break;
+    case Screen::ERR_STALL:
+      StatusLed::show(StatusLed::BLINK_2);
+      break;
+    case Screen::ERR_GLITCHES:
+      StatusLed::show(StatusLed::BLINK_3);
+      break;
+    case Screen::ERR_WATCHDOG:
+      StatusLed::show(StatusLed::BLINK_5);
       break;
     }
+    // All of the pass, remote commands and EEPROM writes included.
+    Diagnostics::loop_cycles(Clock::now() - loop_start);
+
+    // If nothing is going on at all, we don't even need the timer. Not
+    // with the quadrature encoder though: to follow the screen being moved
+    // by hand, it needs the comparator, which can't wake us from power-down.
+    sleep_until_event(!QUADRATURE_ENCODER
+                      && !screen.is_moving() && !StatusLed::is_blinking()
+                      && !special_keys_active.is_active()
+#if SYNC_BUS
+                      && SyncBus::is_idle()
+#endif
+#if LEARN_REMOTES
+                      && RemoteTable::any_button_over
+#endif
+                      && !trigger_settling.is_active()
+                      && infrared.is_idle());
   }
   return 0;  // not reached.
 }
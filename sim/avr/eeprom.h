@@ -0,0 +1,40 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Host simulation: EEMEM variables live in their own section, which the
+// simulator erases to 0xFF when booting; it keeps it over a power cycle.
+// Each byte written goes through the simulator, which can have the power
+// fail in between.
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM __attribute__((section("sim_eeprom")))
+
+void sim_eeprom_write(uint8_t *p, uint8_t value);
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p) { return *p; }
+static inline uint16_t eeprom_read_word(const uint16_t *p) { return *p; }
+static inline void eeprom_write_byte(uint8_t *p, uint8_t value) {
+  sim_eeprom_write(p, value);
+}
+static inline void eeprom_write_word(uint16_t *p, uint16_t value) {
+  sim_eeprom_write((uint8_t*) p, value);
+  sim_eeprom_write((uint8_t*) p + 1, value >> 8);
+}
+static inline void eeprom_update_byte(uint8_t *p, uint8_t value) {
+  if (*p != value) eeprom_write_byte(p, value);
+}
+static inline void eeprom_update_word(uint16_t *p, uint16_t value) {
+  if (*p != value) eeprom_write_word(p, value);
+}
+static inline void eeprom_read_block(void *dst, const void *src, size_t n) {
+  memcpy(dst, src, n);
+}
+static inline void eeprom_update_block(const void *src, void *dst, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    eeprom_update_byte((uint8_t*) dst + i, ((const uint8_t*) src)[i]);
+}
+
+#endif  // SIM_AVR_EEPROM_H
@@ -0,0 +1,15 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Host simulation: interrupt handlers are plain functions that the
+// simulator calls by their vector name.
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) extern "C" void vector(void)
+#define EMPTY_INTERRUPT(vector) extern "C" void vector(void) {}
+
+static inline void sei() { SREG |= 0x80; }
+static inline void cli() { SREG &= ~0x80; }
+
+#endif  // SIM_AVR_INTERRUPT_H
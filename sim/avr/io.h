@@ -0,0 +1,162 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Host simulation: the I/O registers of the ATtiny24 are plain variables,
+// defined in sim.cc. The simulator reads the outputs from them and updates
+// the inputs (PINx, TCNT1, ACO...) while the firmware sleeps.
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+#define SIM_REG8(name)  extern volatile uint8_t name
+#define SIM_REG16(name) extern volatile uint16_t name
+
+SIM_REG8(PORTA); SIM_REG8(PINA); SIM_REG8(DDRA);
+SIM_REG8(PORTB); SIM_REG8(PINB); SIM_REG8(DDRB);
+SIM_REG8(ACSR); SIM_REG8(DIDR0);
+SIM_REG8(ADMUX); SIM_REG8(ADCSRA); SIM_REG8(ADCSRB);
+SIM_REG8(ADCH); SIM_REG8(ADCL);
+SIM_REG8(TCCR0A); SIM_REG8(TCCR0B); SIM_REG8(TCNT0);
+SIM_REG8(OCR0A); SIM_REG8(OCR0B); SIM_REG8(TIMSK0); SIM_REG8(TIFR0);
+SIM_REG8(TCCR1A); SIM_REG8(TCCR1B); SIM_REG8(TCCR1C);
+SIM_REG16(TCNT1); SIM_REG16(OCR1A); SIM_REG16(OCR1B); SIM_REG16(ICR1);
+SIM_REG8(TIMSK1); SIM_REG8(TIFR1);
+SIM_REG8(GIMSK); SIM_REG8(GIFR); SIM_REG8(PCMSK0); SIM_REG8(PCMSK1);
+SIM_REG8(MCUCR); SIM_REG8(MCUSR); SIM_REG8(WDTCSR); SIM_REG8(PRR);
+SIM_REG8(OSCCAL); SIM_REG8(SREG);
+SIM_REG8(GPIOR0); SIM_REG8(GPIOR1); SIM_REG8(GPIOR2);
+
+// Timer0
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+#define WGM00 0
+#define WGM01 1
+#define COM0B0 4
+#define COM0B1 5
+#define COM0A0 6
+#define COM0A1 7
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+#define TOV0 0
+#define OCF0A 1
+#define OCF0B 2
+
+// Timer1
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define ICNC1 7
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1 5
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+#define ICF1 5
+
+// Analog comparator
+#define ACIS0 0
+#define ACIS1 1
+#define ACIC 2
+#define ACIE 3
+#define ACI 4
+#define ACO 5
+#define ACBG 6
+#define ACD 7
+
+// ADC
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define ADTS0 0
+#define ADTS1 1
+#define ADTS2 2
+#define ADLAR 4
+#define ACME 6
+#define BIN 7
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define MUX4 4
+#define MUX5 5
+#define REFS0 6
+#define REFS1 7
+#define ADC0D 0
+#define ADC1D 1
+#define ADC2D 2
+#define ADC3D 3
+#define ADC4D 4
+#define ADC5D 5
+#define ADC6D 6
+#define ADC7D 7
+
+// External and pin change interrupts
+#define PCIE0 4
+#define PCIE1 5
+#define INT0 6
+#define INTF0 6
+#define PCIF0 4
+#define PCIF1 5
+#define PCINT0 0
+#define PCINT1 1
+#define PCINT2 2
+#define PCINT3 3
+#define PCINT4 4
+#define PCINT5 5
+#define PCINT6 6
+#define PCINT7 7
+#define PCINT8 0
+#define PCINT9 1
+#define PCINT10 2
+#define PCINT11 3
+
+// MCU control, reset and watchdog
+#define ISC00 0
+#define ISC01 1
+#define BODSE 2
+#define SM0 3
+#define SM1 4
+#define SE 5
+#define PUD 6
+#define BODS 7
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDCE 4
+#define WDP3 5
+#define WDIE 6
+#define WDIF 7
+
+// Power reduction
+#define PRADC 0
+#define PRUSI 1
+#define PRTIM0 2
+#define PRTIM1 3
+
+#define RAMEND 0xDF
+#define E2END 0x7F
+
+#endif  // SIM_AVR_IO_H
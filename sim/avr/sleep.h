@@ -0,0 +1,22 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Host simulation: sleeping is where simulated time passes.
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE     0
+#define SLEEP_MODE_ADC      (1<<SM0)
+#define SLEEP_MODE_PWR_DOWN (1<<SM1)
+#define SLEEP_MODE_STANDBY  ((1<<SM0) | (1<<SM1))
+
+void sim_sleep_cpu();
+
+static inline void set_sleep_mode(uint8_t mode) {
+  MCUCR = (MCUCR & ~((1<<SM0) | (1<<SM1))) | mode;
+}
+static inline void sleep_enable() { MCUCR |= (1<<SE); }
+static inline void sleep_disable() { MCUCR &= ~(1<<SE); }
+static inline void sleep_cpu() { sim_sleep_cpu(); }
+
+#endif  // SIM_AVR_SLEEP_H
@@ -0,0 +1,26 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Host simulation: the watchdog. The simulator checks the timeout.
+#ifndef SIM_AVR_WDT_H
+#define SIM_AVR_WDT_H
+
+#include <avr/io.h>
+
+#define WDTO_15MS   0
+#define WDTO_30MS   1
+#define WDTO_60MS   2
+#define WDTO_120MS  3
+#define WDTO_250MS  4
+#define WDTO_500MS  5
+#define WDTO_1S     6
+#define WDTO_2S     7
+
+void sim_wdt_reset();
+
+static inline void wdt_reset() { sim_wdt_reset(); }
+static inline void wdt_enable(uint8_t timeout) {
+  sim_wdt_reset();
+  WDTCSR = (1<<WDE) | (timeout & 0x07) | ((timeout & 0x08) ? (1<<WDP3) : 0);
+}
+static inline void wdt_disable() { WDTCSR = 0; }
+
+#endif  // SIM_AVR_WDT_H
@@ -0,0 +1,913 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Scenarios for the host simulation. Each one boots the firmware, injects
+// remote control presses and faults and checks what the motor does.
+
+#include "sim.h"
+
+using namespace sim;
+
+namespace {
+// Command bytes of the Epson remote.
+enum {
+  IR_ON   = 0x09,
+  IR_OFF  = 0x89,
+  IR_UP   = 0x0D,
+  IR_DOWN = 0x4D,
+  IR_SET  = 0xA1,
+};
+
+const double FULL_LENGTH = 258;   // Ticks; the stop without preset.
+const double FRAME_MS = 80;       // Enough for a frame to arrive.
+
+// Deterministic, so that a failing variant can be re-run.
+class Random {
+public:
+  explicit Random(unsigned seed) : state_(seed * 2654435761u + 1) {}
+  unsigned next(unsigned n) {
+    state_ = state_ * 1103515245u + 12345u;
+    return (state_ >> 16) % n;
+  }
+private:
+  unsigned state_;
+};
+
+// LED changes in 'periods' repetitions of the status pattern.
+unsigned long led_changes_in(int periods) {
+  const unsigned long changes = led_changes();
+  run_ms(periods * 2048);
+  return led_changes() - changes;
+}
+
+// Press a button and wait until it has been received.
+void command(uint8_t code, double hold_ms = 0) {
+  press(code, hold_ms);
+  run_ms(FRAME_MS + hold_ms);
+}
+
+// Boot at home, go all the way down.
+void boot_and_go_down() {
+  boot(0);
+  run_ms(100);
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+}
+
+void boot_homes(int) {
+  boot(120);
+  run_ms(100);
+  EXPECT(motor() < 0);
+  EXPECT(run_until_stopped(30000));
+  EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+  run_ms(3000);
+  EXPECT(!led());
+}
+Scenario s1("boot_homes", boot_homes);
+
+void boot_at_home_stays(int) {
+  boot(0);
+  run_ms(2000);
+  EXPECT(motor() == 0);
+  EXPECT_NEAR(plant().pos, 0, 0.5);
+}
+Scenario s2("boot_at_home_stays", boot_at_home_stays);
+
+// Power off and on again where the screen stands.
+void power_cycle() {
+  power_off();
+  run_ms(1000);
+  power_up(plant().pos);
+  run_ms(100);
+}
+
+// Down a bit and back up, 'count' times: a stored position each.
+void short_trips(int count) {
+  for (int i = 0; i < count; ++i) {
+    command(IR_ON);
+    run_ms(1000);
+    command(IR_OFF);
+    EXPECT(run_until_stopped(10000));
+    run_ms(500);
+  }
+}
+
+// After a clean stop, the position survives a power cycle: no homing run.
+// Variant 1: after so many moves that the ring of slots in EEPROM wrapped
+// around.
+void position_restored(int variant) {
+  boot(0);
+  run_ms(100);
+  short_trips(variant == 1 ? 10 : 0);
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  run_ms(500);                 // Done coasting: stored.
+  power_cycle();
+  run_ms(1000);
+  EXPECT(motor() == 0);
+  EXPECT(led_changes_in(1) == 0);
+  command(IR_ON);              // Knows it's down: goes up.
+  EXPECT(motor() < 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+}
+Scenario s32("position_restored", position_restored, 2);
+
+// Power lost while moving: the position isn't known, so it homes.
+void power_lost_while_moving(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_ON);
+  run_ms(5000);
+  EXPECT(motor() > 0);
+  power_cycle();
+  EXPECT(motor() < 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+  EXPECT(led_changes_in(1) == 0);
+}
+Scenario s33("power_lost_while_moving", power_lost_while_moving);
+
+// The power fails while the position is written at the stop, after as many
+// bytes as the variant. Only a complete slot counts; otherwise the one
+// before it, marked as moving, is the newest: homing. All slots have been
+// written before, with the position at home.
+void power_lost_while_storing(int variant) {
+  boot(0);
+  run_ms(100);
+  short_trips(8);
+  command(IR_ON);
+  run_ms(1000);                // The last slot from home is invalid now.
+  power_fail_after_eeprom_writes(variant);
+  EXPECT(run_until_stopped(40000));
+  run_ms(500);
+  power_cycle();
+  const bool complete = variant >= 4;   // Position, state, sequence.
+  EXPECT(complete ? motor() == 0 : motor() < 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(complete ? plant().pos > 200 : plant().pos <= 0.5);
+}
+Scenario s34("power_lost_while_storing", power_lost_while_storing, 5);
+
+// A slot from a clean stop with a position that can't be: the EEPROM
+// doesn't keep what was written. Homes, and blinks four times until the
+// next button.
+void corrupt_position(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  run_ms(500);
+  power_off();
+  // The slot: position, 0xA5 for a clean stop, sequence number.
+  size_t size;
+  uint8_t *const e = eeprom(&size);
+  int corrupted = 0;
+  for (size_t i = 0; i + 2 < size; i += 2) {
+    const short pos = e[i] | e[i + 1] << 8;
+    if (e[i + 2] == 0xA5 && pos > 200 && pos < 300) {
+      e[i + 1] = 0x7F;
+      ++corrupted;
+    }
+  }
+  EXPECT(corrupted == 1);
+  power_up(plant().pos);
+  run_ms(100);
+  EXPECT(motor() < 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+  EXPECT(led_changes_in(2) == 2 * 8);   // Four blinks.
+  command(IR_ON);
+  EXPECT(motor() > 0);
+  EXPECT(led_changes_in(1) == 0);
+}
+Scenario s35("corrupt_position", corrupt_position);
+
+void on_goes_down_and_up(int) {
+  boot_and_go_down();
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+  const unsigned long writes = eeprom_writes();
+  command(IR_ON);
+  EXPECT(motor() < 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+  run_ms(500);                        // Done coasting.
+  EXPECT(eeprom_writes() > writes);   // Position stored.
+}
+Scenario s3("on_goes_down_and_up", on_goes_down_and_up);
+
+void soft_start(int) {
+  boot(0);
+  run_ms(100);
+  press(IR_ON);
+  run_ms(FRAME_MS + 20);
+  EXPECT(motor() > 0);
+  EXPECT(motor_duty() < 200);
+  run_ms(1000);
+  EXPECT(motor_duty() == 255);
+}
+Scenario s4("soft_start", soft_start);
+
+void stall_stops_motor(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_ON);
+  run_ms(3000);
+  plant().jammed = true;
+  const double jammed_at = now_ms();
+  while (motor() != 0 && now_ms() - jammed_at < 2000)
+    run_ms(1);
+  EXPECT(motor() == 0);
+  EXPECT(now_ms() - jammed_at < 400);
+  run_ms(100);
+  EXPECT(led_changes_in(2) == 2 * 4);   // Two blinks.
+}
+Scenario s5("stall_stops_motor", stall_stops_motor);
+
+// The motor gets slower and slower over 3s, down to a tenth, e.g. the
+// fabric getting caught. The ticks keep coming, but once they're
+// STALL_FACTOR times slower than at full speed in this move, that's a
+// stall.
+void slowdown_stops_motor(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_ON);
+  run_ms(3000);
+  for (int i = 0; i <= 300 && motor() != 0; ++i) {
+    plant().max_speed = 15 - 13.5 * i / 300;
+    run_ms(10);
+  }
+  EXPECT(motor() == 0);
+  EXPECT(plant().max_speed > 15.0 / STALL_FACTOR / 2);   // Soon enough.
+  run_ms(100);
+  EXPECT(led_changes_in(2) == 2 * 4);   // Two blinks.
+}
+Scenario s37("slowdown_stops_motor", slowdown_stops_motor);
+
+void dead_encoder_stops_motor(int) {
+  boot(0);
+  plant().encoder_dead = true;
+  run_ms(100);
+  command(IR_ON);
+  EXPECT(motor() > 0);
+  run_ms(1100);
+  EXPECT(motor() == 0);
+  EXPECT(led_changes_in(2) == 2 * 2);   // Slow blinking.
+}
+Scenario s6("dead_encoder_stops_motor", dead_encoder_stops_motor);
+
+void broken_endswitch(int) {
+  boot_and_go_down();
+  plant().endswitch_broken = true;
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos < 0 && plant().pos > plant().top_stop);
+  EXPECT(led_changes_in(1) == 16);       // Fast blinking.
+}
+Scenario s7("broken_endswitch", broken_endswitch);
+
+void program_preset(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_OFF);             // Up/down and set are active for 4s.
+  command(IR_DOWN);
+  EXPECT(motor() > 0);
+  run_ms(3000);
+  command(IR_SET);             // Stop here...
+  EXPECT(run_until_stopped(1000));
+  run_ms(500);                 // Done coasting.
+  const double preset = plant().pos;
+  EXPECT(preset > 20 && preset < 200);
+  command(IR_SET);             // ... and store it.
+  EXPECT(!led());
+  command(IR_ON);              // Stopped somewhere down: goes up.
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5);
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, preset, 3);
+}
+Scenario s8("program_preset", program_preset);
+
+// Pressing ON going down selects the next preset. Past it already, the
+// screen stops; it doesn't turn round in the middle of the move.
+void preset_cycle_stops(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_OFF);
+  command(IR_DOWN);
+  run_ms(3000);
+  command(IR_SET);
+  EXPECT(run_until_stopped(1000));
+  run_ms(500);
+  const double preset = plant().pos;
+  command(IR_SET);             // First preset; the others are full length.
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  run_ms(500);
+  command(IR_ON);              // Down to the first preset...
+  command(IR_ON);              // ... no, the second.
+  run_ms(6000);
+  EXPECT(plant().pos > preset + 10);
+  command(IR_ON);              // Third.
+  EXPECT(motor() > 0);
+  command(IR_ON);              // First again: above us.
+  EXPECT(run_until_stopped(1000));
+  EXPECT(plant().pos > preset + 10);
+}
+Scenario s31("preset_cycle_stops", preset_cycle_stops);
+
+void up_down_need_off_first(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_DOWN);
+  run_ms(500);
+  EXPECT(motor() == 0);
+}
+Scenario s9("up_down_need_off_first", up_down_need_off_first);
+
+void held_button_repeats(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_OFF);
+  command(IR_DOWN, 5000);      // Held for longer than the 4s window.
+  EXPECT(motor() > 0);
+}
+Scenario s10("held_button_repeats", held_button_repeats);
+
+void repeat_without_frame_ignored(int) {
+  boot(0);
+  run_ms(100);
+  const double repeat[] = { 0, 9000, 2250, 560 };
+  ir_pulses(repeat, 4);
+  run_ms(500);
+  EXPECT(motor() == 0);
+}
+Scenario s11("repeat_without_frame_ignored", repeat_without_frame_ignored);
+
+#if LEARN_REMOTES
+// Repeat codes starting long after the frame don't repeat it, wherever the
+// 16 bit clock wrapped meanwhile; the variants start them 130ms apart.
+// Taken as held, SET would start learning a remote.
+void stale_repeat_ignored(int variant) {
+  boot(0);
+  run_ms(100);
+  command(IR_SET);
+  std::vector<double> repeats;
+  for (int i = 0; i < 25; ++i) {
+    repeats.push_back(i == 0 ? 500000 + variant * 130000 : 96190);
+    repeats.push_back(9000);
+    repeats.push_back(2250);
+    repeats.push_back(560);
+  }
+  ir_pulses(repeats.data(), repeats.size());
+  run_ms(500 + variant * 130 + 25 * 108);
+  EXPECT(led_changes_in(1) == 0);
+}
+Scenario s30("stale_repeat_ignored", stale_repeat_ignored, 4);
+#endif
+
+void wakes_from_power_down(int) {
+  boot(0);
+  run_ms(70000);               // Long idle: power-down.
+  command(IR_ON);
+  EXPECT(motor() > 0);
+}
+Scenario s12("wakes_from_power_down", wakes_from_power_down);
+
+// Variant 0 with the comparator, 1 with the ADC: the first move calibrates
+// the sensor levels.
+void encoder_glitches_rejected(int variant) {
+  if (variant == 0) {
+    boot(0);
+    run_ms(100);
+  } else {
+    boot_and_go_down();
+    command(IR_ON);
+    EXPECT(run_until_stopped(40000));
+    run_ms(500);
+  }
+  press(IR_ON);
+  for (int i = 1; i < 30; ++i)
+    encoder_glitch(i * 517, 200);
+  run_ms(FRAME_MS);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+}
+Scenario s13("encoder_glitches_rejected", encoder_glitches_rejected, 2);
+
+// Variants as above.
+void glitch_storm_stops_motor(int variant) {
+  if (variant == 0) {
+    boot(0);
+    run_ms(100);
+  } else {
+    boot_and_go_down();
+    command(IR_ON);
+    EXPECT(run_until_stopped(40000));
+    run_ms(500);
+  }
+  command(IR_ON);
+  run_ms(2000);
+  EXPECT(motor() > 0);
+  for (int i = 0; i < 200; ++i)
+    encoder_glitch(i * 3, 200);
+  run_ms(700);
+  EXPECT(motor() == 0);
+  run_ms(500);
+  EXPECT(led_changes_in(2) == 2 * 6);   // Three blinks.
+}
+Scenario s17("glitch_storm_stops_motor", glitch_storm_stops_motor, 2);
+
+// The main loop hangs while the motor runs: the watchdog interrupt stops
+// it, the next timeout resets the chip.
+void watchdog_stops_motor(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_ON);
+  run_ms(2000);
+  EXPECT(motor() > 0);
+  hang_main_loop(5000);
+  run_ms(300);
+  EXPECT(motor() == 0);
+  EXPECT(watchdog_resets() == 0);
+  run_ms(300);
+  EXPECT(watchdog_resets() == 1);
+}
+Scenario s19("watchdog_stops_motor", watchdog_stops_motor);
+
+// After the reset, the firmware starts again and carries on down from the
+// state in .noinit: no homing run.
+void watchdog_reset_resumes(int) {
+  boot(0);
+  run_ms(100);
+  command(IR_ON);
+  run_ms(2000);
+  hang_main_loop(5000);
+  bool went_up = false;
+  for (int i = 0; i < 100; ++i) {   // Reset after 500ms, 64ms start-up.
+    run_ms(10);
+    went_up |= motor() < 0;
+  }
+  EXPECT(watchdog_resets() == 1);
+  EXPECT(motor() > 0);
+  for (int i = 0; i < 4000 && (motor() != 0 || plant().speed != 0); ++i) {
+    run_ms(10);
+    went_up |= motor() < 0;
+  }
+  EXPECT(!went_up);
+  // What moved while it hung wasn't counted: a bit further down. On the
+  // way up, the endswitch sets the count right.
+  EXPECT(plant().pos > FULL_LENGTH - 3 && plant().pos < FULL_LENGTH + 16);
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+  EXPECT(led_changes_in(1) == 0);
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+}
+Scenario s38("watchdog_reset_resumes", watchdog_reset_resumes);
+
+// It hangs again after carrying on: the next reset leaves the motor off
+// and blinks five times, until the power is cycled; then it homes.
+// Variant 1: the screen stopped cleanly in between, so it carries on again.
+void watchdog_resumes_once(int variant) {
+  boot(0);
+  run_ms(100);
+  command(IR_ON);
+  run_ms(2000);
+  hang_main_loop(5000);
+  run_ms(1000);
+  EXPECT(watchdog_resets() == 1);
+  EXPECT(motor() > 0);
+  if (variant == 1) {
+    EXPECT(run_until_stopped(40000));
+    run_ms(500);
+    command(IR_ON);
+    run_ms(2000);
+    EXPECT(motor() < 0);
+  }
+  hang_main_loop(5000);
+  run_ms(1000);
+  EXPECT(watchdog_resets() == 2);
+  if (variant == 1) {
+    EXPECT(motor() < 0);
+    EXPECT(run_until_stopped(40000));
+    EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+    EXPECT(led_changes_in(1) == 0);
+    return;
+  }
+  EXPECT(motor() == 0);
+  EXPECT(led_changes_in(2) == 2 * 10);   // Five blinks.
+  command(IR_ON);
+  EXPECT(motor() == 0);
+  power_cycle();
+  EXPECT(motor() < 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+  EXPECT(led_changes_in(1) == 0);
+}
+Scenario s39("watchdog_resumes_once", watchdog_resumes_once, 2);
+
+#if DIAGNOSTICS
+// Holding SET after OFF sends the diagnostics over the LED pin.
+void diagnostics_dump(int) {
+  boot_and_go_down();
+  run_ms(500);                 // Done coasting: that was one move.
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  run_ms(500);
+  const double broken[] = { 0, 9000, 4500, 560 };   // Frame stops midway.
+  ir_pulses(broken, 4);
+  run_ms(100);
+  command(IR_OFF);             // At home already; doesn't move.
+  command(IR_SET, 2500);
+  EXPECT(motor() == 0);
+  const std::vector<uint8_t> b = uart_bytes();
+  EXPECT(b.size() == 26);
+  if (b.size() != 26)
+    return;
+  uint8_t sum = 0;
+  for (int i = 0; i < 25; ++i)
+    sum += b[i];
+  EXPECT(b[25] == sum);
+  EXPECT(b[24] == 4);                          // Version.
+  EXPECT(b[23] == 1);                          // Boots.
+  EXPECT((int8_t) b[21] >= -2 && (int8_t) b[21] <= 2);   // Home error.
+  EXPECT((b[0] | b[1] << 8) == 2);             // Moves.
+  EXPECT_NEAR(b[2] | b[3] << 8, FULL_LENGTH, 3);
+  EXPECT((b[4] | b[5] << 8) <= (b[6] | b[7] << 8));   // Tick periods.
+  EXPECT((b[10] | b[11] << 8) == 0);           // Rejected IR frames.
+  EXPECT((b[12] | b[13] << 8) == 1);           // IR timeouts.
+  for (int i = 16; i <= 20; ++i)
+    EXPECT(b[i] == 0);                         // Errors.
+  run_ms(2000);
+  EXPECT(!led());              // Special keys timed out.
+}
+Scenario s18("diagnostics_dump", diagnostics_dump);
+#endif
+
+#if LEARN_REMOTES
+// Another remote: plain NEC, address and its inverse.
+const uint16_t OTHER_REMOTE = 0x20DF;
+const uint8_t other_buttons[] = { 0x10, 0x11, 0x12, 0x13, 0x14 };  // ON..SET
+
+void remote_command(uint8_t code, double hold_ms = 0) {
+  press_remote(OTHER_REMOTE, code, hold_ms);
+  run_ms(FRAME_MS + hold_ms);
+}
+
+// Teach the other remote, one button after the other, as the LED asks for.
+void learn_other_remote() {
+  for (unsigned i = 0; i < 5; ++i) {
+    EXPECT(led_changes_in(1) == 2 * (i + 1));   // Blinks: the button number.
+    remote_command(other_buttons[i]);
+  }
+}
+
+// Holding SET (without OFF before) learns a remote. Its buttons work like
+// the Epson ones then, and those still do.
+void learn_remote(int variant) {
+  boot(0);
+  run_ms(61000);               // Past the first minute.
+  remote_command(other_buttons[0], 2500);
+  EXPECT(led_changes_in(1) == 0);   // Unknown: doesn't start learning.
+  command(variant == 0 ? IR_SET : IR_UP, 2500);   // Not any other button.
+  EXPECT(led_changes_in(1) == (variant == 0 ? 2 : 0));
+  if (variant != 0)
+    return;
+  remote_command(other_buttons[0]);
+  press_remote(0x1234, 0x55);  // Another remote isn't learned meanwhile.
+  run_ms(FRAME_MS);
+  remote_command(other_buttons[0]);   // Taken already by ON: skipped.
+  for (unsigned i = 1; i < 5; ++i) {
+    EXPECT(led_changes_in(1) == 2 * (i + 1));
+    remote_command(other_buttons[i]);
+  }
+  run_ms(2000);
+  EXPECT(led_changes_in(1) == 0);
+  EXPECT(motor() == 0);
+  remote_command(other_buttons[0]);   // ON
+  EXPECT(motor() > 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+  run_ms(500);
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5);
+  remote_command(other_buttons[1]);   // OFF: up/down active now.
+  remote_command(other_buttons[3]);   // DOWN
+  EXPECT(motor() > 0);
+}
+Scenario s23("learn_remote", learn_remote, 2);
+
+// In the first minute after power-up, holding any button of a remote
+// starts learning. Learning stops if no button comes for a while.
+void learn_after_power_up(int variant) {
+  boot(0);
+  run_ms(1000);
+  remote_command(other_buttons[4], 2500);
+  if (variant == 0) {
+    learn_other_remote();
+    run_ms(1000);
+    remote_command(other_buttons[0]);
+    EXPECT(motor() > 0);
+  } else {
+    remote_command(other_buttons[0]);
+    remote_command(other_buttons[1]);
+    run_ms(11000);
+    EXPECT(led_changes_in(1) == 0);
+    remote_command(other_buttons[0]);
+    EXPECT(motor() == 0);      // Nothing stored.
+  }
+}
+Scenario s24("learn_after_power_up", learn_after_power_up, 2);
+
+#if RC5_SONY
+// Remotes speaking RC5 or Sony SIRC with 12, 15 or 20 bits can be learned
+// as well. A Sony press sends three frames, which doesn't toggle twice.
+void press_protocol(int variant, uint8_t code, double hold_ms = 0) {
+  if (variant == 0)
+    press_rc5(0x05, code, hold_ms);
+  else
+    press_sony(variant == 1 ? 12 : variant == 2 ? 15 : 20,
+               variant == 1 ? 0x01 : variant == 2 ? 0x9A : 0x1A3, code,
+               hold_ms);
+  run_ms(200 + hold_ms);
+}
+
+void other_protocols(int variant) {
+  boot(0);
+  run_ms(1000);
+  press_protocol(variant, 0x40, 2500);   // Field bit of RC5 set.
+  for (unsigned i = 0; i < 5; ++i) {
+    EXPECT(led_changes_in(1) == 2 * (i + 1));
+    press_protocol(variant, 0x40 + i);
+  }
+  run_ms(1000);
+  EXPECT(led_changes_in(1) == 0);
+  press_protocol(variant, 0x40);         // ON
+  run_ms(2000);
+  EXPECT(motor() > 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+  press_protocol(variant, 0x41);         // OFF
+  EXPECT(motor() < 0);
+}
+Scenario s25("other_protocols", other_protocols, 4);
+#endif
+#endif
+
+#if WIRED_TRIGGER
+// The wired trigger moves the screen at once, also out of power-down. The
+// contacts bouncing don't make it change its mind; the level after that
+// counts.
+void wired_trigger_moves(int variant) {
+  boot(0);
+  run_ms(61000);
+  for (int i = 0; i < 5; ++i)
+    wired_trigger(i % 2 == 0, i * 0.3);   // Ends active.
+  run_ms(1);
+  EXPECT(motor() > 0);
+  run_ms(100);
+  EXPECT(motor() > 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+  if (variant == 1) {
+    wired_trigger(false);           // A glitch: goes up for a moment.
+    wired_trigger(true, 20);
+    run_ms(10);
+    EXPECT(motor() < 0);
+    EXPECT(run_until_stopped(40000));   // And back down.
+    EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+  }
+  for (int i = 0; i < 5; ++i)
+    wired_trigger(i % 2 != 0, i * 0.3);   // Ends released.
+  run_ms(1);
+  EXPECT(motor() < 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5);
+}
+Scenario s26("wired_trigger", wired_trigger_moves, 2);
+#endif
+
+#if SYNC_BUS == 1
+// The master tells where it is going, and how fast once running; then
+// where it stopped.
+void sync_master(int) {
+  boot(0);
+  run_ms(100);
+  std::vector<SyncMessage> m = sync_messages();
+  EXPECT(m.size() == 1 && m[0].target == 0 && m[0].period == 0);
+  command(IR_ON);
+  run_ms(1000);
+  m = sync_messages();
+  EXPECT(m.size() >= 3);
+  EXPECT(m[1].target == FULL_LENGTH && m[1].period == 0);
+  EXPECT(m.back().target == FULL_LENGTH && m.back().period != 0);
+  EXPECT(run_until_stopped(40000));
+  run_ms(100);
+  m = sync_messages();
+  EXPECT_NEAR(m.back().target, plant().pos, 1);
+  EXPECT(m.back().period == 0);
+}
+Scenario s27("sync_master", sync_master);
+#endif
+
+#if SYNC_BUS == 2
+// A follower goes where the master says, at the master's speed, which is
+// slower than its own here.
+// Variant 1 waits in power-down first, for the leader to wake it up.
+void sync_follower(int variant) {
+  const uint16_t period = CPU_HZ / CLOCK_PRESCALER / 10;   // 10 ticks/s.
+  boot(0);
+  run_ms(variant == 0 ? 100 : 70000);
+  send_sync(FULL_LENGTH, 0);
+  run_ms(100);
+  EXPECT(motor() > 0);
+  for (int i = 0; i < 40; ++i) {
+    send_sync(FULL_LENGTH, period);
+    run_ms(250);
+  }
+  EXPECT_NEAR(plant().speed, 10, 1.5);
+  send_sync(FULL_LENGTH, 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+  send_sync(FULL_LENGTH - 1, 0);   // Not worth a move.
+  run_ms(100);
+  EXPECT(motor() == 0);
+  send_sync(100, 0);
+  run_ms(100);
+  EXPECT(motor() < 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, 100, 3);
+  send_sync(-4, 0);                 // Up, until the endswitch.
+  run_ms(100);
+  EXPECT(motor() < 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5);
+}
+Scenario s28("sync_follower", sync_follower, 2);
+#endif
+
+#if QUADRATURE_ENCODER
+// With the second channel, the count follows the screen pulled by hand
+// with the motor off, both ways. It is stored once the screen stands
+// still, and the next stop is where it should be. Variant 0 starts from
+// home, variant 1 after a move down, counting the ticks coasting as well.
+void moved_by_hand(int variant) {
+  boot(0);
+  run_ms(100);
+  if (variant == 1) {
+    command(IR_ON);
+    EXPECT(run_until_stopped(40000));
+    run_ms(500);
+  }
+  const double start = plant().pos;
+  const double way = variant == 0 ? 1 : -1;   // First down, or up.
+  plant().pulled = 10 * way;                  // 100 ticks...
+  run_ms(10000);
+  plant().pulled = -4 * way;                  // ... and 40 back.
+  run_ms(10000);
+  plant().pulled = 0;
+  EXPECT(run_until_stopped(1000));
+  run_ms(500);
+  EXPECT(motor() == 0);
+  EXPECT_NEAR(plant().pos, start + 60 * way, 1);
+  power_cycle();
+  EXPECT(motor() == 0);        // Knows where it is.
+  command(IR_OFF);             // Starts up, and enables DOWN...
+  command(IR_DOWN);            // ... to the full length.
+  EXPECT(motor() > 0);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+}
+Scenario s36("moved_by_hand", moved_by_hand, 2);
+#endif
+
+// The wheel counts more ticks going down than up. Each round trip shows
+// that at the endswitch; the correction makes the screen stop at the same
+// length again.
+void drift_corrected(int) {
+  boot(0);
+  plant().down_scale = 0.03;
+  run_ms(100);
+  double first = 0;
+  for (int trip = 0; trip < 6; ++trip) {
+    command(IR_ON);
+    EXPECT(run_until_stopped(40000));
+    if (trip == 0)
+      first = plant().pos;
+    run_ms(500);
+    command(IR_ON);
+    EXPECT(run_until_stopped(40000));
+    run_ms(500);
+  }
+  EXPECT(first < FULL_LENGTH - 5);             // Without correction.
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 2);
+}
+Scenario s22("drift_corrected", drift_corrected);
+
+// The first move calibrates the ADC Schmitt trigger. It needs to follow
+// when the sensor ages afterwards.
+void sensor_drift(int) {
+  boot_and_go_down();
+  plant().sensor_mid = 90;
+  plant().sensor_amplitude = 50;
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+}
+Scenario s14("sensor_drift", sensor_drift);
+
+// Glitches on a calibrated sensor don't move the learned levels: the moves
+// after them are as precise as before.
+void sensor_glitches_after_calibration(int) {
+  boot_and_go_down();
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  run_ms(500);
+  for (int trip = 0; trip < 2; ++trip) {
+    press(IR_ON);
+    for (int i = 1; i < 40; ++i)
+      encoder_glitch(i * 311, 150);
+    run_ms(FRAME_MS);
+    EXPECT(run_until_stopped(40000));
+    run_ms(500);
+    command(IR_ON);
+    EXPECT(run_until_stopped(40000));
+    EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+    run_ms(500);
+  }
+  command(IR_ON);
+  EXPECT(run_until_stopped(40000));
+  EXPECT_NEAR(plant().pos, FULL_LENGTH, 3);
+}
+Scenario s29("sensor_glitches_after_calibration",
+             sensor_glitches_after_calibration);
+
+// A transmission that stops midway doesn't eat the next frame's leader.
+void infrared_broken_frame(int) {
+  boot(0);
+  run_ms(100);
+  const double broken[] = { 0, 9000, 4500, 560, 560, 560 };
+  ir_pulses(broken, 6);
+  run_ms(50);
+  command(IR_ON);
+  EXPECT(motor() > 0);
+}
+Scenario s20("infrared_broken_frame", infrared_broken_frame);
+
+// A TSOP stuck low for a while doesn't block the remote afterwards.
+void infrared_stuck_low(int) {
+  boot(0);
+  run_ms(100);
+  const double stuck[] = { 0, 3000000 };
+  ir_pulses(stuck, 2);
+  run_ms(3100);
+  command(IR_ON);
+  EXPECT(motor() > 0);
+}
+Scenario s21("infrared_stuck_low", infrared_stuck_low);
+
+// Random junk on the infrared input doesn't move the screen.
+void infrared_noise(int variant) {
+  Random random(variant);
+  boot(0);
+  run_ms(100);
+  double pulses[200];
+  for (int i = 0; i < 200; ++i)
+    pulses[i] = 100 + random.next(12000);
+  ir_pulses(pulses, 200);
+  run_ms(2000);
+  EXPECT(motor() == 0);
+}
+Scenario s15("infrared_noise", infrared_noise, 100);
+
+// Random buttons at random times: the screen stays within its limits and
+// finds home afterwards.
+void button_mash(int variant) {
+  static const uint8_t buttons[] = { IR_ON, IR_OFF, IR_UP, IR_DOWN, IR_SET };
+  Random random(variant);
+  boot(random.next(2) ? 0 : 100);
+  run_ms(100);
+  for (int i = 0; i < 20; ++i) {
+    command(buttons[random.next(5)], random.next(3) ? 0 : random.next(1500));
+    run_ms(random.next(4000));
+    EXPECT(plant().pos > plant().top_stop && plant().pos < FULL_LENGTH + 5);
+  }
+  EXPECT(run_until_stopped(40000));
+  command(IR_OFF);
+  EXPECT(run_until_stopped(40000));
+  EXPECT(plant().pos <= 0.5 && plant().pos >= -4);
+  run_ms(5000);
+  const unsigned long changes = led_changes();
+  run_ms(3000);
+  EXPECT(led_changes() == changes);   // No error blinking.
+}
+Scenario s16("button_mash", button_mash, 50);
+}  // namespace
@@ -0,0 +1,880 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Simulated ATtiny24 peripherals and screen mechanics; the scenario runner.
+//
+// Time only passes while the firmware sleeps: sim_sleep_cpu() advances
+// from event to event (timer overflow and compare, a step of the mechanics,
+// an ADC conversion, a scheduled input change) until one of them raises an
+// interrupt, then calls the handler and returns to the firmware's main loop.
+// The firmware runs on a stack of its own; when the time a scenario asked
+// for is up, the simulator switches back to the scenario. Busy waiting
+// (_delay_us()) advances the time as well, but the handlers of interrupts
+// raised meanwhile only run at the next sleep.
+
+#include "sim.h"
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/delay.h>
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <vector>
+
+volatile uint8_t PORTA, PINA, DDRA, PORTB, PINB, DDRB;
+volatile uint8_t ACSR, DIDR0, ADMUX, ADCSRA, ADCSRB, ADCH, ADCL;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0, TIFR0;
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C;
+volatile uint16_t TCNT1, OCR1A, OCR1B, ICR1;
+volatile uint8_t TIMSK1, TIFR1, GIMSK, GIFR, PCMSK0, PCMSK1;
+volatile uint8_t MCUCR, MCUSR, WDTCSR, PRR, OSCCAL, SREG;
+volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+
+// Bounds of the EEMEM section and of the firmware's variables (see the
+// Makefile), provided by the linker.
+extern char __start_sim_eeprom[] __attribute__((weak));
+extern char __stop_sim_eeprom[] __attribute__((weak));
+extern char __start_sim_data[] __attribute__((weak));
+extern char __stop_sim_data[] __attribute__((weak));
+extern char __start_sim_bss[] __attribute__((weak));
+extern char __stop_sim_bss[] __attribute__((weak));
+
+// The firmware's main(), renamed when compiled for the simulation.
+int firmware_main();
+
+// Interrupt vectors of the ATtiny24; the ones the firmware doesn't
+// implement stay null.
+extern "C" {
+#define SIM_VECTOR(name) void name() __attribute__((weak))
+SIM_VECTOR(INT0_vect); SIM_VECTOR(PCINT0_vect); SIM_VECTOR(PCINT1_vect);
+SIM_VECTOR(WDT_vect); SIM_VECTOR(TIM1_CAPT_vect); SIM_VECTOR(TIM1_COMPA_vect);
+SIM_VECTOR(TIM1_COMPB_vect); SIM_VECTOR(TIM1_OVF_vect);
+SIM_VECTOR(TIM0_COMPA_vect); SIM_VECTOR(TIM0_COMPB_vect);
+SIM_VECTOR(TIM0_OVF_vect); SIM_VECTOR(ANA_COMP_vect); SIM_VECTOR(ADC_vect);
+SIM_VECTOR(EE_RDY_vect); SIM_VECTOR(USI_STR_vect); SIM_VECTOR(USI_OVF_vect);
+#undef SIM_VECTOR
+}
+
+namespace sim {
+namespace {
+// Vector numbers; lower number is higher priority.
+enum Vector {
+  VECT_INT0 = 1, VECT_PCINT0, VECT_PCINT1, VECT_WDT, VECT_TIM1_CAPT,
+  VECT_TIM1_COMPA, VECT_TIM1_COMPB, VECT_TIM1_OVF, VECT_TIM0_COMPA,
+  VECT_TIM0_COMPB, VECT_TIM0_OVF, VECT_ANA_COMP, VECT_ADC, VECT_EE_RDY,
+  VECT_USI_STR, VECT_USI_OVF, VECT_COUNT
+};
+
+void (*const vectors[VECT_COUNT])() = {
+  0, INT0_vect, PCINT0_vect, PCINT1_vect, WDT_vect, TIM1_CAPT_vect,
+  TIM1_COMPA_vect, TIM1_COMPB_vect, TIM1_OVF_vect, TIM0_COMPA_vect,
+  TIM0_COMPB_vect, TIM0_OVF_vect, ANA_COMP_vect, ADC_vect, EE_RDY_vect,
+  USI_STR_vect, USI_OVF_vect,
+};
+
+// Pins, as wired in rc-screen.cc. With a crystal (other than 8MHz), motor
+// up and the endswitch are on port A.
+#define CRYSTAL (AVR_MHZ != 8)
+enum {
+#if CRYSTAL
+  PIN_ENDSWITCH   = (1<<5),
+  PIN_MOT_UP      = (1<<3),
+#else
+  PIN_ENDSWITCH   = (1<<1),
+  PIN_MOT_UP      = (1<<0),
+#endif
+  PIN_A3          = (1<<3),   // Trigger or sync bus, without a crystal.
+  PIN_RESET_B     = (1<<3),
+  PIN_IR_A        = (1<<7),
+  PIN_ENCODER2_A  = (1<<5),
+  PIN_LED_A       = (1<<4),
+  PIN_MOT_DN_A    = (1<<6),
+  PIN_MOT_EN_B    = (1<<2),
+};
+
+const uint64_t PLANT_STEP = CPU_HZ / 4000;   // Mechanics: 250us steps.
+
+uint64_t cycles;            // Simulated time in CPU cycles.
+uint64_t timer1_clocked;    // CPU cycles Timer1 has been running.
+uint64_t deadline;          // Back to the scenario then.
+uint64_t next_plant_step;   // 0: mechanics at rest.
+uint64_t next_adc;          // 0: ADC not running.
+bool power_down;
+uint32_t pending;           // Bit per vector.
+uint64_t wdt_kicked;        // Watchdog counts from here.
+uint64_t hang_until;        // Main loop doesn't get anywhere until then.
+bool in_reset;              // Watchdog reset: the firmware is gone.
+uint64_t reset_until;       // Then the chip starts again.
+unsigned long wdt_reset_count;
+bool powered;               // Off: the firmware is gone until power_up().
+unsigned long eeprom_write_count;
+long eeprom_writes_left = -1;   // Until the power fails; -1: it doesn't.
+std::vector<char> initial_data;  // Of the firmware's variables.
+
+Plant the_plant;
+bool ir_level = true;       // TSOP output, idle high.
+bool trigger_active;        // Wired trigger; pulls the input low.
+bool bus_low;               // Sync bus, pulled low by another unit.
+// Levels of the sync bus as the firmware drives it, for sync_messages().
+std::vector<std::pair<uint64_t, bool> > bus_levels;
+bool glitch;                // Encoder channel A inverted right now.
+
+std::multimap<uint64_t, std::function<void()> > actions;
+
+bool last_led;
+int last_motor;
+unsigned long led_change_count;
+
+// Levels of the LED pin during busy waits, for the software UART.
+const double UART_BAUD = 19200;
+std::vector<std::pair<uint64_t, bool> > uart_levels;
+int failure_count;
+bool verbose_output;
+
+ucontext_t scenario_context, firmware_context;
+char firmware_stack[256 * 1024];
+char halted_stack[64 * 1024];   // While the firmware doesn't run.
+
+uint64_t ms_to_cycles(double ms) { return (uint64_t) (ms * CPU_HZ / 1000); }
+uint64_t us_to_cycles(double us) { return (uint64_t) (us * CPU_HZ / 1e6); }
+
+void raise_interrupt(Vector v) { pending |= 1UL << v; }
+
+unsigned timer1_prescaler() {
+  static const unsigned prescaler[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+  return prescaler[TCCR1B & 0x07];
+}
+
+bool wdt_running() { return WDTCSR & ((1<<WDE) | (1<<WDIE)); }
+
+// 2k cycles of the 128kHz watchdog oscillator, doubled per prescaler step.
+uint64_t wdt_timeout() {
+  const unsigned wdp = (WDTCSR & 0x07) | ((WDTCSR & (1<<WDP3)) ? 8 : 0);
+  return (uint64_t) (2048 << wdp) * CPU_HZ / 128000;
+}
+
+// The chip resets: all pins become inputs, nothing runs until the
+// start-up time of the fuses, 64ms, is over.
+void watchdog_reset() {
+  in_reset = true;
+  reset_until = cycles + ms_to_cycles(64);
+  ++wdt_reset_count;
+  DDRA = DDRB = PORTA = PORTB = 0;
+  TCCR0A = TCCR0B = TCCR1B = 0;
+  WDTCSR = 0;
+  pending = 0;
+}
+
+// In power-down, all clocks but the watchdog's are stopped.
+bool timer1_running() { return !power_down && timer1_prescaler() != 0; }
+
+bool adc_running() {
+  return !power_down && (ADCSRA & (1<<ADEN)) && (ADCSRA & (1<<ADATE))
+    && !(PRR & (1<<PRADC));
+}
+
+uint64_t adc_period() {
+  const unsigned adps = ADCSRA & 0x07;
+  return 13 * (adps == 0 ? 2 : 1 << adps);
+}
+
+// Cycles from now until Timer1 counts to 'value' (mod 2^16) next.
+uint64_t cycles_until_timer1(uint16_t value) {
+  const unsigned p = timer1_prescaler();
+  const uint64_t count = timer1_clocked / p;
+  const uint64_t counts = (uint16_t) (value - (uint16_t) count - 1) + 1;
+  return (count + counts) * p - timer1_clocked;
+}
+
+int motor_direction() {
+  const bool down = PORTA & PIN_MOT_DN_A;
+  const bool up = (CRYSTAL ? PORTA : PORTB) & PIN_MOT_UP;
+  return (down == up) ? 0 : (down ? 1 : -1);
+}
+
+uint8_t enable_duty() {
+  if (TCCR0A & (1<<COM0A1))
+    return OCR0A;
+  return (PORTB & PIN_MOT_EN_B) ? 255 : 0;
+}
+
+bool plant_active() {
+  return the_plant.speed != 0 || the_plant.pulled != 0
+    || (motor_direction() && enable_duty());
+}
+
+void plant_step(double dt) {
+  Plant &p = the_plant;
+  const double drive = enable_duty() / 255.0;
+  if (p.jammed) {
+    p.speed = 0;
+  } else if (p.pulled != 0) {
+    p.speed = p.pulled;
+  } else if (motor_direction() != 0 && drive > p.stall_duty) {
+    const double target = motor_direction() * p.max_speed
+      * (drive - p.stall_duty) / (1 - p.stall_duty);
+    const double k = dt / p.time_constant;
+    p.speed += (target - p.speed) * (k < 1 ? k : 1);
+  } else if (fabs(p.speed) <= p.friction * dt) {
+    p.speed = 0;
+  } else {
+    p.speed -= (p.speed > 0 ? 1 : -1) * p.friction * dt;
+  }
+  const double before = p.pos;
+  p.pos += p.speed * dt;
+  if (p.pos < p.top_stop) { p.pos = p.top_stop; p.speed = 0; }
+  if (p.pos > p.bottom_stop) { p.pos = p.bottom_stop; p.speed = 0; }
+  p.encoder_pos += (p.pos - before) * (p.pos > before ? 1 + p.down_scale : 1);
+}
+
+// Analog level of the wheel sensor: one stripe per tick.
+double sensor_phase() {
+  if (the_plant.encoder_dead)
+    return 0;
+  const double s = sin(M_PI * the_plant.encoder_pos);
+  return glitch ? -s : s;
+}
+
+void adc_sample() {
+  int value = the_plant.sensor_mid
+    + (int) lround(the_plant.sensor_amplitude * sensor_phase());
+  if (value < 0) value = 0;
+  if (value > 255) value = 255;
+  ADCH = value;   // ADLAR: 8 bit in the high byte.
+  ADCL = 0;
+  if (ADCSRA & (1<<ADIE))
+    raise_interrupt(VECT_ADC);
+}
+
+// Inputs from the state of the world. Raises the interrupts for changes.
+void update_inputs() {
+  const bool a = sensor_phase() > 0;
+  const bool b = !the_plant.encoder_dead
+    && sin(M_PI * (the_plant.encoder_pos + 0.5)) > 0;
+  const bool endswitch = !the_plant.endswitch_broken && the_plant.pos <= 0.5;
+
+  const uint8_t switch_open = endswitch ? 0 : PIN_ENDSWITCH;
+  const uint8_t in_a = (ir_level ? PIN_IR_A : 0)
+    | (CRYSTAL ? switch_open : (b ? PIN_ENCODER2_A : 0)
+       | (trigger_active || bus_low ? 0 : PIN_A3));
+  const uint8_t in_b = PIN_RESET_B | (CRYSTAL ? 0 : switch_open);
+  const uint8_t pina = (PORTA & DDRA) | (in_a & ~DDRA);
+  const uint8_t pinb = (PORTB & DDRB) | (in_b & ~DDRB);
+
+  if ((pina ^ PINA) & PCMSK0 && (GIMSK & (1<<PCIE0)))
+    raise_interrupt(VECT_PCINT0);
+  if ((pinb ^ PINB) & PCMSK1 && (GIMSK & (1<<PCIE1)))
+    raise_interrupt(VECT_PCINT1);
+  if ((pina ^ PINA) & PIN_IR_A && timer1_running()) {
+    const bool rising = (pina & PIN_IR_A) != 0;
+    if (rising == ((TCCR1B & (1<<ICES1)) != 0)) {
+      ICR1 = TCNT1;
+      if (TIMSK1 & (1<<ICIE1))
+        raise_interrupt(VECT_TIM1_CAPT);
+    }
+  }
+  PINA = pina;
+  PINB = pinb;
+
+  // Comparator output; follows the sensor unless switched off.
+  if (!(ACSR & (1<<ACD)) && a != ((ACSR & (1<<ACO)) != 0)) {
+    ACSR = a ? (ACSR | (1<<ACO)) : (ACSR & ~(1<<ACO));
+    const uint8_t mode = ACSR & ((1<<ACIS1) | (1<<ACIS0));
+    if ((ACSR & (1<<ACIE))
+        && (mode == 0 || (mode == (1<<ACIS1)) != a))
+      raise_interrupt(VECT_ANA_COMP);
+  }
+}
+
+// (Re-)start the periodic things that depend on what the firmware did.
+void reschedule() {
+  if (!plant_active())
+    next_plant_step = 0;
+  else if (next_plant_step == 0)
+    next_plant_step = cycles + PLANT_STEP;
+  if (!adc_running())
+    next_adc = 0;
+  else if (next_adc == 0)
+    next_adc = cycles + adc_period();
+}
+
+uint64_t next_event() {
+  uint64_t t = deadline;
+  if (timer1_running()) {
+    const uint64_t ovf = cycles + cycles_until_timer1(0);
+    const uint64_t cmp = cycles + cycles_until_timer1(OCR1A);
+    if (ovf < t) t = ovf;
+    if (cmp < t) t = cmp;
+    if (TIMSK1 & (1<<OCIE1B)) {
+      const uint64_t cmp_b = cycles + cycles_until_timer1(OCR1B);
+      if (cmp_b < t) t = cmp_b;
+    }
+  }
+  if (next_plant_step && next_plant_step < t) t = next_plant_step;
+  if (next_adc && next_adc < t) t = next_adc;
+  if (wdt_running() && wdt_kicked + wdt_timeout() < t)
+    t = wdt_kicked + wdt_timeout();
+  if (!actions.empty() && actions.begin()->first < t)
+    t = actions.begin()->first;
+  return t > cycles ? t : cycles;
+}
+
+void advance_to(uint64_t t) {
+  if (timer1_running()) {
+    const unsigned p = timer1_prescaler();
+    const uint64_t before = timer1_clocked / p;
+    timer1_clocked += t - cycles;
+    const uint64_t after = timer1_clocked / p;
+    TCNT1 = (uint16_t) after;
+    if ((before >> 16) != (after >> 16)) {
+      TIFR1 |= (1<<TOV1);
+      if (TIMSK1 & (1<<TOIE1))
+        raise_interrupt(VECT_TIM1_OVF);
+    }
+    const uint64_t to_compare = (uint16_t) (OCR1A - (uint16_t) before - 1) + 1;
+    if (to_compare <= after - before && (TIMSK1 & (1<<OCIE1A)))
+      raise_interrupt(VECT_TIM1_COMPA);
+    const uint64_t to_b = (uint16_t) (OCR1B - (uint16_t) before - 1) + 1;
+    if (to_b <= after - before && (TIMSK1 & (1<<OCIE1B)))
+      raise_interrupt(VECT_TIM1_COMPB);
+  }
+  cycles = t;
+  if (wdt_running() && cycles >= wdt_kicked + wdt_timeout()) {
+    wdt_kicked = cycles;
+    if (WDTCSR & (1<<WDIE)) {
+      if (cycles >= hang_until) {
+        printf("  watchdog timeout at %.1fms\n", now_ms());
+        ++failure_count;
+      }
+      WDTCSR = (WDTCSR & ~(1<<WDIE)) | (1<<WDIF);
+      raise_interrupt(VECT_WDT);
+    } else {
+      watchdog_reset();
+    }
+  }
+  if (next_plant_step && cycles >= next_plant_step) {
+    plant_step((double) PLANT_STEP / CPU_HZ);
+    next_plant_step += PLANT_STEP;
+  }
+  if (next_adc && cycles >= next_adc) {
+    adc_sample();
+    next_adc += adc_period();
+  }
+  while (!actions.empty() && actions.begin()->first <= cycles) {
+    std::function<void()> action = actions.begin()->second;
+    actions.erase(actions.begin());
+    action();
+  }
+  update_inputs();
+}
+
+// Call pending interrupt handlers in the order of their priority. Like on
+// the chip, the I bit is cleared while in the handler.
+void dispatch() {
+  for (int v = 1; v < VECT_COUNT; ++v) {
+    if (!(pending & (1UL << v)))
+      continue;
+    pending &= ~(1UL << v);
+    if (v == VECT_TIM1_OVF)
+      TIFR1 &= ~(1<<TOV1);
+    if (!vectors[v]) {
+      // On the chip, that jumps to the reset vector.
+      printf("  interrupt %d enabled without handler\n", v);
+      exit(1);
+    }
+    const uint8_t sreg = SREG;
+    SREG &= ~0x80;
+    vectors[v]();
+    SREG = sreg | 0x80;
+  }
+}
+
+void log_outputs() {
+  const bool bus_now = !CRYSTAL && (DDRA & PIN_A3) && !(PORTA & PIN_A3);
+  if (bus_levels.empty() || bus_levels.back().second != bus_now)
+    bus_levels.push_back(std::make_pair(cycles, bus_now));
+  const bool led_now = PORTA & PIN_LED_A;
+  if (led_now != last_led) {
+    last_led = led_now;
+    ++led_change_count;
+  }
+  if (motor_direction() != last_motor) {
+    last_motor = motor_direction();
+    if (verbose_output)
+      printf("  %9.1fms motor %-4s pos %6.1f\n", now_ms(),
+             last_motor == 0 ? "off" : (last_motor > 0 ? "down" : "up"),
+             the_plant.pos);
+  }
+}
+
+void yield_to_scenario() {
+  swapcontext(&firmware_context, &scenario_context);
+}
+
+void firmware_entry() {
+  firmware_main();
+  fprintf(stderr, "firmware main() returned\n");
+  exit(2);
+}
+
+// What runs in place of the firmware from the next swap to it on.
+void new_firmware_context(void (*entry)(), char *stack, size_t size) {
+  getcontext(&firmware_context);
+  firmware_context.uc_stack.ss_sp = stack;
+  firmware_context.uc_stack.ss_size = size;
+  firmware_context.uc_link = 0;
+  makecontext(&firmware_context, entry, 0);
+}
+
+// Power-on values: all pins inputs, the motor stops.
+void reset_registers() {
+  volatile uint8_t *const regs8[] = {
+    &PORTA, &DDRA, &PORTB, &DDRB, &ACSR, &DIDR0, &ADMUX, &ADCSRA, &ADCSRB,
+    &ADCH, &ADCL, &TCCR0A, &TCCR0B, &TCNT0, &OCR0A, &OCR0B, &TIMSK0, &TIFR0,
+    &TCCR1A, &TCCR1B, &TCCR1C, &TIMSK1, &TIFR1, &GIMSK, &GIFR, &PCMSK0,
+    &PCMSK1, &MCUCR, &MCUSR, &WDTCSR, &PRR, &OSCCAL, &SREG, &GPIOR0,
+    &GPIOR1, &GPIOR2,
+  };
+  for (volatile uint8_t *r : regs8)
+    *r = 0;
+  TCNT1 = OCR1A = OCR1B = ICR1 = 0;
+  timer1_clocked = 0;
+  next_adc = 0;
+  pending = 0;
+  power_down = false;
+  hang_until = 0;
+  log_outputs();
+}
+
+// The chip starts: the firmware's variables as at the start of the
+// program, and a fresh stack for main().
+void start_firmware(uint8_t reset_flags) {
+  reset_registers();
+  MCUSR = reset_flags;
+  in_reset = false;
+  powered = true;
+  char *const data = __start_sim_data;
+  if (initial_data.empty())
+    initial_data.assign(data, __stop_sim_data);
+  std::copy(initial_data.begin(), initial_data.end(), data);
+  std::fill(__start_sim_bss, __stop_sim_bss, 0);
+  PINB = (CRYSTAL ? 0 : PIN_ENDSWITCH) | PIN_RESET_B;
+  PINA = (CRYSTAL ? PIN_ENDSWITCH : PIN_A3) | PIN_IR_A;
+  update_inputs();
+  pending = 0;
+  new_firmware_context(firmware_entry, firmware_stack, sizeof(firmware_stack));
+}
+
+// The chip has no power or is in reset: only the world goes on. After a
+// reset, the firmware starts again; .noinit stays as it was.
+void halted() {
+  for (;;) {
+    if (powered && in_reset && cycles >= reset_until) {
+      start_firmware(1<<WDRF);
+      setcontext(&firmware_context);
+    }
+    if (cycles >= deadline) {
+      yield_to_scenario();
+      continue;
+    }
+    reschedule();
+    const uint64_t t = next_event();
+    advance_to(powered && in_reset && reset_until < t ? reset_until : t);
+    log_outputs();
+  }
+}
+
+// Called on the firmware's stack when it is gone; doesn't return. halted()
+// runs on a stack of its own, so it can start the firmware over.
+void leave_firmware() {
+  new_firmware_context(halted, halted_stack, sizeof(halted_stack));
+  setcontext(&firmware_context);
+}
+
+void cut_power() {
+  powered = false;
+  eeprom_writes_left = -1;
+  reset_registers();
+}
+
+void schedule(double delay_us, const std::function<void()> &action) {
+  actions.insert(std::make_pair(cycles + us_to_cycles(delay_us), action));
+}
+
+// NEC frame. The bytes are sent in the order DecodeInfrared() sees them.
+const uint16_t EPSON_ADDRESS = 0xC1AA;
+
+double schedule_pulse(double at_us, double low_us, double high_us) {
+  schedule(at_us, [] { ir_level = false; });
+  schedule(at_us + low_us, [] { ir_level = true; });
+  return at_us + low_us + high_us;
+}
+
+struct ScenarioEntry {
+  const char *name;
+  ScenarioFun fun;
+  int variants;
+};
+
+std::vector<ScenarioEntry> &registry() {
+  static std::vector<ScenarioEntry> scenarios;
+  return scenarios;
+}
+}  // namespace
+
+Plant &plant() { return the_plant; }
+
+void boot(double pos) {
+  std::fill(__start_sim_eeprom, __stop_sim_eeprom, 0xFF);
+  power_up(pos);
+}
+
+void power_off() {
+  if (!powered)
+    return;
+  cut_power();
+  new_firmware_context(halted, halted_stack, sizeof(halted_stack));
+}
+
+void power_up(double pos) {
+  power_off();
+  the_plant.pos = the_plant.encoder_pos = pos;
+  the_plant.speed = 0;
+  start_firmware(1<<PORF);
+  deadline = cycles;   // Just run until the first sleep.
+  swapcontext(&scenario_context, &firmware_context);
+}
+
+void power_fail_after_eeprom_writes(unsigned long bytes) {
+  eeprom_writes_left = bytes;
+}
+
+uint8_t *eeprom(size_t *size) {
+  *size = __stop_sim_eeprom - __start_sim_eeprom;
+  return (uint8_t*) __start_sim_eeprom;
+}
+
+void run_ms(double ms) {
+  deadline = cycles + ms_to_cycles(ms);
+  swapcontext(&scenario_context, &firmware_context);
+}
+
+bool run_until_stopped(double timeout_ms) {
+  const uint64_t end = cycles + ms_to_cycles(timeout_ms);
+  while (motor() != 0 || the_plant.speed != 0) {
+    if (cycles >= end)
+      return false;
+    run_ms(10);
+  }
+  return true;
+}
+
+double now_ms() { return cycles * 1000.0 / CPU_HZ; }
+
+void press(uint8_t command, double hold_ms) {
+  press_remote(EPSON_ADDRESS, command, hold_ms);
+}
+
+void press_remote(uint16_t address, uint8_t command, double hold_ms) {
+  const uint8_t frame[4] = { (uint8_t) (address >> 8), (uint8_t) address,
+                             command, (uint8_t) ~command };
+  double t = schedule_pulse(1000, 9000, 4500);
+  for (int i = 0; i < 32; ++i) {
+    const bool one = frame[i / 8] & (0x80 >> (i % 8));
+    t = schedule_pulse(t, 560, one ? 1690 : 560);
+  }
+  schedule_pulse(t, 560, 0);
+  for (double start = 1000 + 108000; start < 1000 + hold_ms * 1000;
+       start += 108000) {
+    schedule_pulse(schedule_pulse(start, 9000, 2250), 560, 0);
+  }
+}
+
+void press_rc5(uint8_t address, uint8_t command, double hold_ms) {
+  static bool toggle;
+  toggle = !toggle;
+  const unsigned bits = 1 << 13 | !(command & 0x40) << 12 | toggle << 11
+    | (address & 0x1F) << 6 | (command & 0x3F);
+  const double half = 889;
+  for (double start = 1000; start == 1000 || start < 1000 + hold_ms * 1000;
+       start += 113778) {
+    // A one is high, then low. Idle is high, the input ends high.
+    for (int i = 0; i < 28; ++i) {
+      const bool one = bits & (1 << (13 - i / 2));
+      const bool level = (i % 2 == 0) == one;
+      schedule(start + i * half, [level] { ir_level = level; });
+    }
+    schedule(start + 28 * half, [] { ir_level = true; });
+  }
+}
+
+void press_sony(int bits, uint16_t address, uint8_t command, double hold_ms) {
+  const uint32_t frame = (uint32_t) address << 7 | (command & 0x7F);
+  for (int n = 0; n < 3 || n * 45000 < hold_ms * 1000; ++n) {
+    double t = schedule_pulse(1000 + n * 45000, 2400, 600);
+    for (int i = 0; i < bits; ++i)
+      t = schedule_pulse(t, (frame & (1UL << i)) ? 1200 : 600, 600);
+  }
+}
+
+void ir_pulses(const double *us, int count) {
+  double t = 0;
+  for (int i = 0; i < count; ++i) {
+    t += us[i];
+    const bool level = (i % 2) != 0;
+    schedule(t, [level] { ir_level = level; });
+  }
+}
+
+void wired_trigger(bool active, double delay_ms) {
+  schedule(delay_ms * 1000, [active] { trigger_active = active; });
+}
+
+void send_sync(short target, uint16_t period) {
+  const uint8_t frame[5] = {
+    (uint8_t) target, (uint8_t) (target >> 8), (uint8_t) period,
+    (uint8_t) (period >> 8),
+    (uint8_t) (1 + (uint8_t) target + (target >> 8) + period + (period >> 8))
+  };
+  double t = 0;
+  auto phase = [&t](bool low, double us) {
+    schedule(t, [low] { bus_low = low; });
+    t += us;
+  };
+  phase(true, 2000);
+  phase(false, 500);
+  for (int i = 0; i < 40; ++i) {
+    phase(true, (frame[i / 8] >> (i % 8)) & 1 ? 750 : 250);
+    phase(false, 250);
+  }
+}
+
+std::vector<SyncMessage> sync_messages() {
+  std::vector<SyncMessage> messages;
+  uint8_t frame[5];
+  int bit = -1;   // Not in a frame.
+  for (size_t i = 1; i + 1 < bus_levels.size(); ++i) {
+    if (!bus_levels[i].second)
+      continue;
+    const double low_us = (bus_levels[i + 1].first - bus_levels[i].first)
+      * 1e6 / CPU_HZ;
+    if (low_us > 1500) {
+      bit = 0;
+      continue;
+    }
+    if (bit < 0)
+      continue;
+    if (bit % 8 == 0)
+      frame[bit / 8] = 0;
+    frame[bit / 8] |= (low_us > 500) << (bit % 8);
+    if (++bit < 40)
+      continue;
+    bit = -1;
+    if ((uint8_t) (1 + frame[0] + frame[1] + frame[2] + frame[3]) != frame[4])
+      continue;
+    const SyncMessage m = { (short) (frame[0] | frame[1] << 8),
+                            (uint16_t) (frame[2] | frame[3] << 8) };
+    messages.push_back(m);
+  }
+  return messages;
+}
+
+void hang_main_loop(double ms) {
+  hang_until = cycles + ms_to_cycles(ms);
+}
+
+unsigned long watchdog_resets() { return wdt_reset_count; }
+
+void encoder_glitch(double delay_ms, double duration_us) {
+  schedule(delay_ms * 1000, [] { glitch = true; });
+  schedule(delay_ms * 1000 + duration_us, [] { glitch = false; });
+}
+
+int motor() {
+  return motor_direction() && enable_duty() ? motor_direction() : 0;
+}
+uint8_t motor_duty() { return motor_direction() ? enable_duty() : 0; }
+bool led() { return PORTA & PIN_LED_A; }
+unsigned long led_changes() { return led_change_count; }
+unsigned long eeprom_writes() { return eeprom_write_count; }
+
+std::vector<uint8_t> uart_bytes() {
+  std::vector<uint8_t> bytes;
+  const double bit = CPU_HZ / UART_BAUD;
+  auto level_at = [](double t) {
+    bool level = true;
+    for (const auto &l : uart_levels) {
+      if (l.first > t) break;
+      level = l.second;
+    }
+    return level;
+  };
+  double frame_end = 0;
+  for (size_t i = 1; i < uart_levels.size(); ++i) {
+    const double start = uart_levels[i].first;
+    // Start bit: falling edge after the end of the previous frame.
+    if (uart_levels[i].second || !uart_levels[i - 1].second
+        || start < frame_end)
+      continue;
+    uint8_t b = 0;
+    for (int k = 0; k < 8; ++k)
+      b |= level_at(start + (1.5 + k) * bit) << k;
+    if (!level_at(start + 9.5 * bit))
+      continue;   // Framing error.
+    bytes.push_back(b);
+    frame_end = start + 9.5 * bit;
+  }
+  return bytes;
+}
+
+void expect(bool condition, const char *what, const char *file, int line) {
+  if (condition)
+    return;
+  ++failure_count;
+  printf("  %s:%d: expected %s (at %.1fms, screen at %.1f)\n",
+         file, line, what, now_ms(), the_plant.pos);
+}
+
+int failures() { return failure_count; }
+bool verbose() { return verbose_output; }
+
+Scenario::Scenario(const char *name, ScenarioFun fun, int variants) {
+  ScenarioEntry entry = { name, fun, variants };
+  registry().push_back(entry);
+}
+}  // namespace sim
+
+// The firmware sleeps: let the world happen until an interrupt wakes it.
+void sim_sleep_cpu() {
+  using namespace sim;
+  if (!(MCUCR & (1<<SE)))
+    return;
+  if (!(SREG & 0x80)) {
+    printf("  sleeping with interrupts disabled: would never wake up\n");
+    exit(1);
+  }
+  log_outputs();
+  // Standby is power-down with the crystal running.
+  const uint8_t mode = MCUCR & ((1<<SM1) | (1<<SM0));
+  power_down = mode == SLEEP_MODE_PWR_DOWN || mode == SLEEP_MODE_STANDBY;
+  while (!pending) {
+    if (cycles >= deadline) {
+      yield_to_scenario();
+      continue;
+    }
+    reschedule();
+    advance_to(next_event());
+    if (in_reset)
+      leave_firmware();
+  }
+  power_down = false;
+  dispatch();
+  // The main loop hangs: time goes on, interrupts are served.
+  while (cycles < hang_until) {
+    if (cycles >= deadline) {
+      yield_to_scenario();
+      continue;
+    }
+    reschedule();
+    const uint64_t t = next_event();
+    advance_to(t < hang_until ? t : hang_until);
+    if (in_reset)
+      leave_firmware();
+    dispatch();
+    log_outputs();
+  }
+}
+
+void sim_wdt_reset() { sim::wdt_kicked = sim::cycles; }
+
+void sim_eeprom_write(uint8_t *p, uint8_t value) {
+  using namespace sim;
+  if (eeprom_writes_left == 0) {
+    cut_power();
+    leave_firmware();
+  }
+  if (eeprom_writes_left > 0)
+    --eeprom_writes_left;
+  ++eeprom_write_count;
+  *p = value;
+}
+
+void sim_delay_us(double us) {
+  using namespace sim;
+  const bool level = PORTA & PIN_LED_A;
+  if (uart_levels.empty() || uart_levels.back().second != level)
+    uart_levels.push_back(std::make_pair(cycles, level));
+  advance_to(cycles + us_to_cycles(us));
+  if (in_reset)
+    leave_firmware();
+}
+
+// Runs each scenario in a fresh process. Arguments: -v for a trace of the
+// motor, -l to list; others select scenarios whose name contains them.
+int main(int argc, char *argv[]) {
+  std::vector<const char*> filters;
+  bool list = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-v") == 0) sim::verbose_output = true;
+    else if (strcmp(argv[i], "-l") == 0) list = true;
+    else filters.push_back(argv[i]);
+  }
+  struct timeval start, end;
+  gettimeofday(&start, 0);
+  int count = 0, failed = 0;
+  for (const sim::ScenarioEntry &s : sim::registry()) {
+    bool selected = filters.empty();
+    for (const char *f : filters)
+      selected |= strstr(s.name, f) != 0;
+    if (!selected)
+      continue;
+    for (int variant = 0; variant < s.variants; ++variant) {
+      char name[128];
+      if (s.variants > 1)
+        snprintf(name, sizeof(name), "%s/%d", s.name, variant);
+      else
+        snprintf(name, sizeof(name), "%s", s.name);
+      if (list) {
+        printf("%s\n", name);
+        continue;
+      }
+      ++count;
+      if (sim::verbose_output)
+        printf("%s\n", name);
+      fflush(stdout);
+      const pid_t pid = fork();
+      if (pid == 0) {
+        alarm(30);   // Firmware stuck without sleeping.
+        s.fun(variant);
+        fflush(stdout);
+        _exit(sim::failures() ? 1 : 0);
+      }
+      int status;
+      waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ++failed;
+        printf("FAIL %s%s\n", name,
+               WIFSIGNALED(status) ? (WTERMSIG(status) == SIGALRM
+                                      ? " (timeout)" : " (crashed)") : "");
+      }
+    }
+  }
+  if (list)
+    return 0;
+  gettimeofday(&end, 0);
+  printf("%d scenarios, %d failed (%.2fs)\n", count, failed,
+         (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+  return failed ? 1 : 0;
+}
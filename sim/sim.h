@@ -0,0 +1,142 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Host simulation of rc-screen: the firmware runs unchanged against the
+// mocked registers in sim/avr/. While it sleeps, the simulator advances the
+// time, runs the timers, the comparator, the ADC and a model of the screen
+// mechanics, and calls the interrupt handlers.
+//
+// Scenarios are written top-down: boot(), inject events, run_ms(), check
+// the outputs. Each scenario runs in a process of its own, so the firmware
+// always starts from fresh static state.
+#ifndef SIM_SIM_H
+#define SIM_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#ifndef AVR_MHZ
+#  define AVR_MHZ 8
+#endif
+
+namespace sim {
+static const unsigned long CPU_HZ = AVR_MHZ * 1000000UL;  // Same as F_CPU.
+
+// Mechanics of the screen. Positions in encoder ticks (stripe edges) from
+// the home position, positive is down.
+struct Plant {
+  double pos = 0;
+  double speed = 0;              // Ticks per second.
+  double max_speed = 15;         // At full duty cycle.
+  double stall_duty = 0.3;       // Below that, the motor doesn't turn.
+  double time_constant = 0.05;   // Motor speed-up, seconds.
+  double friction = 50;          // Deceleration coasting, ticks/s^2.
+  double top_stop = -8;          // Mechanical limits.
+  double bottom_stop = 300;
+  bool jammed = false;           // Doesn't move, whatever the motor does.
+  double pulled = 0;             // By hand, ticks per second; sets the speed.
+  bool endswitch_broken = false;
+  bool encoder_dead = false;     // Sensor gives no signal anymore.
+  // The encoder wheel sees this much more going down than up, e.g. from
+  // the fabric winding up unevenly. Dead reckoning drifts.
+  double down_scale = 0;
+  double encoder_pos = 0;        // What the wheel has seen.
+
+  // Analog signal of the wheel sensor, as seen by the ADC.
+  int sensor_mid = 128;
+  int sensor_amplitude = 80;
+};
+
+Plant &plant();
+
+// Start the firmware with the screen at the given position, with an erased
+// EEPROM.
+void boot(double pos);
+
+// Cut the power: the firmware stops, the screen coasts to a halt.
+void power_off();
+// Power comes back (after power_off(), if it wasn't yet) with the screen at
+// 'pos'. Unlike boot(), the EEPROM has what the firmware wrote before.
+void power_up(double pos);
+// The power fails when the firmware writes to the EEPROM after another
+// 'bytes' bytes, as if it had been cut right then. Once.
+void power_fail_after_eeprom_writes(unsigned long bytes);
+// The EEPROM content; for corrupting it.
+uint8_t *eeprom(size_t *size);
+
+// Let the simulated time advance.
+void run_ms(double ms);
+
+// Run until the motor is off and the screen stands still, at most
+// 'timeout_ms'. Returns false on timeout.
+bool run_until_stopped(double timeout_ms);
+
+double now_ms();
+
+// Infrared input: single NEC frame from the Epson remote with the given
+// command; held for 'hold_ms' with repeat codes. Starts right now, does
+// not wait.
+void press(uint8_t command, double hold_ms = 0);
+// Same from another NEC remote; 'address' is the first two bytes of the
+// frame, high byte first.
+void press_remote(uint16_t address, uint8_t command, double hold_ms = 0);
+// An RC5 remote: 5 bit address, 7 bit command. The toggle bit flips with
+// each press; held, the frame repeats every 114ms.
+void press_rc5(uint8_t address, uint8_t command, double hold_ms = 0);
+// A Sony remote with 12, 15 or 20 bit frames: 7 bits command, the rest is
+// the address. At least three frames, every 45ms.
+void press_sony(int bits, uint16_t address, uint8_t command,
+                double hold_ms = 0);
+
+// Raw edges on the infrared input, 'us' after the previous one, starting
+// now. The first one goes low.
+void ir_pulses(const double *us, int count);
+
+// Wired trigger input (WIRED_TRIGGER), changing 'delay_ms' from now.
+void wired_trigger(bool active, double delay_ms = 0);
+
+// Sync bus (SYNC_BUS): a frame from the master, starting now. 'period' in
+// Timer1 cycles, 0: the master's motor is off.
+void send_sync(short target, uint16_t period);
+// Frames the firmware sent as master so far.
+struct SyncMessage {
+  short target;
+  uint16_t period;
+};
+std::vector<SyncMessage> sync_messages();
+
+// Invert the encoder signal for a short time, starting 'delay_ms' from now.
+void encoder_glitch(double delay_ms, double duration_us);
+
+// The firmware's main loop gets stuck after it wakes up next, for 'ms';
+// interrupt handlers still run. A watchdog reset ends it.
+void hang_main_loop(double ms);
+
+// Outputs.
+int motor();             // -1: up, 0: off, +1: down.
+uint8_t motor_duty();    // 0..255
+bool led();
+unsigned long led_changes();   // Counted since boot.
+unsigned long eeprom_writes();
+unsigned long watchdog_resets();   // The firmware starts again 64ms later.
+// Bytes sent over the LED pin so far: 19200 baud 8N1.
+std::vector<uint8_t> uart_bytes();
+
+// Failed expectations are reported with location; the scenario continues.
+void expect(bool condition, const char *what, const char *file, int line);
+#define EXPECT(cond) ::sim::expect((cond), #cond, __FILE__, __LINE__)
+#define EXPECT_NEAR(a, b, tolerance)                                   \
+  ::sim::expect((a) - (b) <= (tolerance) && (b) - (a) <= (tolerance),  \
+                #a " near " #b, __FILE__, __LINE__)
+
+// Scenarios register themselves with a static Scenario object.
+typedef void (*ScenarioFun)(int variant);
+struct Scenario {
+  Scenario(const char *name, ScenarioFun fun, int variants = 1);
+};
+
+int failures();
+bool verbose();
+}  // namespace sim
+
+#endif  // SIM_SIM_H
@@ -0,0 +1,12 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Host simulation: busy waiting lets the simulated time pass, without
+// interrupts.
+#ifndef SIM_UTIL_DELAY_H
+#define SIM_UTIL_DELAY_H
+
+void sim_delay_us(double us);
+
+static inline void _delay_us(double us) { sim_delay_us(us); }
+static inline void _delay_ms(double ms) { sim_delay_us(ms * 1000); }
+
+#endif  // SIM_UTIL_DELAY_H
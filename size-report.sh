@@ -0,0 +1,117 @@
+#!/bin/sh
+# Flash and RAM usage of the firmware per symbol, checked against the budget
+# of the chip.
+#
+# Usage: size-report.sh [-q] <elf> <stack-usage-file> <flash-budget> \
+#                       <ram-budget> [<baseline>]
+#  -q: only the totals and what changed compared to the baseline.
+#
+# The stack estimate is the frame of main() plus the largest frame of any
+# other function and of any interrupt handler, plus return addresses. Most
+# of the firmware is inlined into main(), so that is close, but it is not a
+# call graph analysis.
+# Exits with 1 if over budget.
+
+QUIET=0
+if [ "$1" = "-q" ]; then QUIET=1; shift; fi
+ELF=$1
+STACK_USAGE=$2
+FLASH_BUDGET=$3
+RAM_BUDGET=$4
+BASELINE=$5
+NM=${NM:-avr-nm}
+TAB=$(printf '\t')
+
+if [ -z "$RAM_BUDGET" ]; then
+    sed -n '2,13s/^# \{0,1\}//p' "$0"
+    exit 2
+fi
+
+# Totals from the section headers, which include what isn't a symbol, like
+# the vector table and the startup code. .noinit (kept over a watchdog
+# reset) is RAM like .bss; where it starts tells its symbols apart.
+eval $(${SIZE:-avr-size} -A "$ELF" | awk '
+    $1 == ".text" { text = $2 } $1 == ".data" { data = $2 }
+    $1 == ".bss"  { bss = $2 }
+    $1 == ".noinit" { noinit = $2; noinit_addr = $3 }
+    END { printf("TEXT=%d DATA=%d BSS=%d NOINIT=%d NOINIT_ADDR=%d\n",
+                 text, data, bss, noinit, noinit_addr) }')
+
+# One line per symbol: section size name. Sections by address: flash below
+# 0x800000, then RAM, EEPROM from 0x810000.
+SYMBOLS=$(mktemp)
+trap 'rm -f "$SYMBOLS" "$SYMBOLS.diff"' EXIT
+$NM --size-sort -S -C --radix=d "$ELF" | awk -v noinit=$NOINIT \
+                                             -v noinit_addr=$NOINIT_ADDR '
+{
+    addr = $1 + 0; size = $2 + 0; type = $3;
+    name = $4; for (i = 5; i <= NF; ++i) name = name " " $i;
+    if (addr >= 8454144) section = ".eeprom";
+    else if (noinit && addr >= noinit_addr && addr < noinit_addr + noinit)
+        section = ".noinit";
+    else if (addr >= 8388608) section = (type ~ /[bB]/) ? ".bss" : ".data";
+    else section = ".text";
+    print section, size, name;
+}' > "$SYMBOLS"
+
+if [ $QUIET -eq 0 ]; then
+    for section in .text .data .bss .noinit .eeprom; do
+        echo "-- $section"
+        awk -v s=$section '$1 == s { printf("%6d  ", $2);
+              $1 = $2 = ""; sub(/^  /, ""); print }' "$SYMBOLS" | sort -rn
+    done
+    echo "-- stack frames"
+    sort -t "$TAB" -k2 -rn "$STACK_USAGE" \
+        | awk -F'\t' '{ name = $1; sub(/^[^:]*:[0-9]+:[0-9]+:/, "", name);
+                        printf("%6d  %s\n", $2, name) }'
+fi
+
+STACK=$(awk -F'\t' '
+    { size = $2; name = $1 }
+    name ~ /:int main\(/ { main = size; next }
+    name ~ /_vect\(/ || name ~ /__vector_/ { if (size > isr) isr = size; next }
+    { if (size > other) other = size }
+    END { print main + other + isr + 3 * 2 }' "$STACK_USAGE")
+
+FLASH=$((TEXT + DATA))
+RAM=$((DATA + BSS + NOINIT + STACK))
+echo "flash: $FLASH of $FLASH_BUDGET bytes (.text $TEXT, .data $DATA)"
+echo "ram:   $RAM of $RAM_BUDGET bytes (.data $DATA, .bss $BSS," \
+     ".noinit $NOINIT, stack ~$STACK)"
+
+if [ -n "$BASELINE" ] && [ -f "$BASELINE" ]; then
+    # Symbols that appeared, disappeared or changed size.
+    awk '
+    function key_of(line) { sub(/ [0-9]+ /, " ", line); return line }
+    FNR == NR { old[key_of($0)] = $2; next }
+    {
+        key = key_of($0);
+        delta = $2 - old[key];
+        if (!(key in old)) printf("%+6d  %s (new)\n", $2, key);
+        else if (delta != 0) printf("%+6d  %s\n", delta, key);
+        delete old[key];
+    }
+    END { for (key in old) printf("%+6d  %s (gone)\n", -old[key], key) }
+    ' "$BASELINE" "$SYMBOLS" > "$SYMBOLS.diff"
+    if [ -s "$SYMBOLS.diff" ]; then
+        echo "-- changes compared to $BASELINE"
+        sort -rn "$SYMBOLS.diff"
+    fi
+fi
+if [ -n "$BASELINE" ] && [ "$QUIET" -eq 0 ] && [ ! -f "$BASELINE" ]; then
+    echo "(no $BASELINE yet; 'make size-baseline' to compare against this)"
+fi
+if [ -n "$SAVE_BASELINE" ]; then
+    cp "$SYMBOLS" "$SAVE_BASELINE"
+fi
+
+STATUS=0
+if [ $FLASH -gt $FLASH_BUDGET ]; then
+    echo "Over flash budget by $((FLASH - FLASH_BUDGET)) bytes."
+    STATUS=1
+fi
+if [ $RAM -gt $RAM_BUDGET ]; then
+    echo "Over RAM budget by $((RAM - RAM_BUDGET)) bytes."
+    STATUS=1
+fi
+exit $STATUS